@@ -0,0 +1,92 @@
+// Bus servicing during NVS writes.
+// Manual test on hardware. Every NVS write turns off the flash cache and stops the bus tasks.
+// Phase 1 writes whenever it likes, phase 2 waits for the gap after a sync (WaitForBusGap).
+// After each phase (60 s) the missed syncs (frame number gaps, UART overflows, slots missed) are printed.
+// Phase 2 should show fewer: a write starts at the beginning of a gap, but a long write (sector erase)
+// does not end inside it.
+#include <Arduino.h>
+#include <Preferences.h>
+
+#include <vector>
+#include <VEBusDefinition.h>
+#include <VEBus.h>
+#include "config.h"
+
+#define PHASE_DURATION_MS 60000
+
+VEBus _vEBus(Serial1, RS485_RX_PIN, RS485_TX_PIN, RS485_EN_PIN);
+Preferences _preferences;
+
+volatile bool _useBusGap = false;
+volatile uint32_t _writes = 0;
+unsigned long lastSendTime = 0;
+unsigned long phaseStartTime = 0;
+VEBus::Statistics _phaseStart;
+
+void flashWriter(void* args)
+{
+    uint8_t data[256];
+    _preferences.begin("stress", false);
+    while (true)
+    {
+        for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(_writes + i);
+        if (!_useBusGap || _vEBus.WaitForBusGap(100))
+        {
+            _preferences.putBytes("data", data, sizeof(data));
+            _writes++;
+        }
+        delay(5);
+    }
+}
+
+void printPhase(const char* name)
+{
+    VEBus::Statistics stats = _vEBus.GetStats();
+    uint32_t gaps = stats.sequenceGaps - _phaseStart.sequenceGaps;
+    uint32_t overflows = stats.rxOverflows - _phaseStart.rxOverflows;
+    uint32_t tooLate = stats.tooLate - _phaseStart.tooLate;
+    Serial.printf("%s: writes %lu, sent %lu, frame nr gaps %lu, uart overflows %lu, too late %lu -> %s\n", name,
+        (unsigned long)_writes, (unsigned long)(stats.txFrames - _phaseStart.txFrames),
+        (unsigned long)gaps, (unsigned long)overflows, (unsigned long)tooLate,
+        (gaps + overflows + tooLate == 0) ? "no missed syncs" : "syncs missed");
+    _phaseStart = stats;
+    _writes = 0;
+}
+
+void setup()
+{
+    pinMode(RS485_SE_PIN, OUTPUT);
+    digitalWrite(RS485_SE_PIN, HIGH);
+
+    pinMode(PIN_5V_EN, OUTPUT);
+    digitalWrite(PIN_5V_EN, HIGH);
+
+    Serial.begin(256000);
+
+    _vEBus.SetLogLevel(VEBus::LogLevel::None);
+    _vEBus.Setup();
+    _phaseStart = _vEBus.GetStats();
+    phaseStartTime = millis();
+    xTaskCreatePinnedToCore(flashWriter, "flash_writer", 4096, NULL, 1, NULL, 1);
+}
+
+void loop()
+{
+    _vEBus.Maintain();
+
+    //Keep a request staged, so every sync needs an answer
+    if (millis() - lastSendTime > 100)
+    {
+        _vEBus.Read(RamVariables::UBat);
+        lastSendTime = millis();
+    }
+
+    if (millis() - phaseStartTime > PHASE_DURATION_MS)
+    {
+        printPhase(_useBusGap ? "WaitForBusGap" : "Unscheduled");
+        _useBusGap = !_useBusGap;
+        phaseStartTime = millis();
+    }
+
+    delay(10);
+}
@@ -0,0 +1,23 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+// PIN config for Lilygo ESP32 CAN RS485
+#define PIN_5V_EN 16
+
+#define CAN_TX_PIN 26
+#define CAN_RX_PIN 27
+#define CAN_SE_PIN 23
+
+#define RS485_EN_PIN 17 // /RE
+#define RS485_TX_PIN 22 //
+#define RS485_RX_PIN 21 //
+#define RS485_SE_PIN 19 // /SHDN
+
+#define SD_MISO_PIN 2
+#define SD_MOSI_PIN 15
+#define SD_SCLK_PIN 14
+#define SD_CS_PIN 13
+
+#define WS2812_PIN4
+
+#endif
\ No newline at end of file
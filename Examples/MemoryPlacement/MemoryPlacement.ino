@@ -0,0 +1,122 @@
+// Decode and sync-response latency of a VEBus object in internal RAM and in PSRAM.
+// Needs a board with PSRAM (enable PSRAM in the board settings), no bus connection.
+// For each placement a VEBus object is constructed in memory allocated with VEBUS_HOT_CAPS or
+// VEBUS_COLD_CAPS. Setup() is not called, no tasks run and the UART is not started (writes are dropped).
+// Per sample a RAM variable read is queued and staged by the library, then timed:
+//  sync response: the work of the real-time task at a sync (decode queue, bus budget, frame nr, checksum)
+//  decode: the work of the decode task for the response (destuff, match the request, completion)
+// Between two samples a buffer larger than the cache is read, like other tasks do on a busy system.
+// The request fifo always uses VEBUS_HOT_CAPS, request buffers (without VEBUS_NO_HEAP) the default heap.
+#include <Arduino.h>
+#include <algorithm>
+
+#include <VEBusDefinition.h>
+#include <VEBus.h>
+#include "config.h"
+
+#define SAMPLES 2000
+#define EVICT_SIZE (64 * 1024)
+
+uint32_t _syncSamples[SAMPLES];
+uint32_t _decodeSamples[SAMPLES];
+volatile uint32_t _sink = 0;
+uint8_t* _evict;
+
+void evictCache()
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < EVICT_SIZE; i += 32) sum += _evict[i];
+    _sink += sum;
+}
+
+//VEBus.h declares this class as friend for benchmarks, it drives the task functions by hand
+class VEBusBenchmark
+{
+public:
+    //Returns false if the request could not be staged
+    static bool Sample(VEBus& bus, uint8_t frameNr, uint32_t& syncCycles, uint32_t& decodeCycles)
+    {
+        uint8_t id = bus.Read(RamVariables::UBat);
+        if (id == 0) return false;
+        bus.drainSubmissions();
+        bus.stageRequest();
+        if (!bus._txStaged.load()) return false;
+
+        const uint8_t sync[] = { 0x83, 0x83, 0xFD, frameNr, 0x55, 0x00, 0x00, 0x00, 0x11, 0xFF };
+        evictCache();
+        uint32_t start = ESP.getCycleCount();
+        bus.pushDecodeQueue(sync, sizeof(sync), micros(), false);
+        if (bus.takeBusBudget()) bus.sendStagedFrame(frameNr);
+        syncCycles = ESP.getCycleCount() - start;
+
+        //Sync and sent frame, not timed
+        bus.decodeHandling();
+
+        VEBus::RawFrame frame;
+        frame.timeUs = micros();
+        frame.sent = false;
+        const uint8_t response[] = { 0x83, 0x83, 0xFE, (uint8_t)((frameNr + 2) & 0x7F), 0x00, id, 0x85, 0xF2, 0x04 };
+        memcpy(frame.data, response, sizeof(response));
+        frame.size = VEBusFrameCodec::AppendChecksum(frame.data, sizeof(response), sizeof(frame.data));
+
+        evictCache();
+        start = ESP.getCycleCount();
+        bus.decodeFrame(frame);
+        decodeCycles = ESP.getCycleCount() - start;
+
+        while (bus.checkResponseMessage());
+        return true;
+    }
+};
+
+void printSamples(const char* placement, const char* name, uint32_t* samples)
+{
+    std::sort(samples, samples + SAMPLES);
+    float mhz = getCpuFrequencyMhz();
+    Serial.printf("%-10s %-14s p50 %6.2f us  p99 %6.2f us  max %6.2f us\n", placement, name,
+        samples[SAMPLES / 2] / mhz, samples[SAMPLES * 99 / 100] / mhz, samples[SAMPLES - 1] / mhz);
+}
+
+void run(const char* name, uint32_t caps)
+{
+    void* memory = heap_caps_malloc(sizeof(VEBus), caps);
+    if (memory == nullptr)
+    {
+        Serial.printf("%s: allocation failed\n", name);
+        return;
+    }
+    VEBus* bus = new (memory) VEBus(Serial1, RS485_RX_PIN, RS485_TX_PIN, RS485_EN_PIN);
+    bus->SetResponseCallback([](VEBus::ResponseData& data) { _sink += data.id; });
+
+    uint32_t samples = 0;
+    for (; samples < SAMPLES; samples++)
+    {
+        if (!VEBusBenchmark::Sample(*bus, (uint8_t)(samples & 0x7F), _syncSamples[samples], _decodeSamples[samples])) break;
+    }
+
+    if (samples < SAMPLES) Serial.printf("%s: request not staged after %lu samples\n", name, (unsigned long)samples);
+    else
+    {
+        printSamples(name, "sync response", _syncSamples);
+        printSamples(name, "decode", _decodeSamples);
+    }
+    bus->~VEBus();
+    heap_caps_free(memory);
+}
+
+void setup()
+{
+    Serial.begin(256000);
+    delay(1000);
+
+    if (!psramFound()) Serial.println("No PSRAM found, both placements use internal RAM");
+    _evict = (uint8_t*)VEBusContainer::CapsAllocate(EVICT_SIZE, VEBUS_COLD_CAPS);
+
+    run("internal", VEBUS_HOT_CAPS);
+    run("psram", VEBUS_COLD_CAPS);
+}
+
+void loop()
+{
+    delay(1000);
+}
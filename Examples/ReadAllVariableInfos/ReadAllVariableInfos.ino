@@ -31,21 +31,9 @@ struct InfoType
 
 std::vector<InfoType> _SentInfoReads(32);
 
-void destuffingFAtoFF(std::vector<uint8_t>& buffer)
+void Receive(VEBus::Buffer& buffer)
 {
-    for (uint8_t i = 4; i < buffer.size(); i++)
-    {
-        if (buffer[i] == 0xFA && i != buffer.size() - 1)
-        {
-            buffer[i] = buffer[i + 1] + 0x80;
-            buffer.erase(buffer.begin() + i + 1);
-        }
-    }
-}
-
-void Receive(std::vector<uint8_t>& buffer)
-{
-    destuffingFAtoFF(buffer);
+    _vEBus.DestuffingFAtoFF(buffer);
     for (size_t i = 0; i < _SentInfoReads.size(); i++)
     {
         if (0x00 != buffer[4] || _SentInfoReads[i].id != buffer[5]) continue;
@@ -14,11 +14,11 @@ unsigned long lastSendTime = 0;
 //Blacklist for receive callback
 VEBus::Blacklist _blacklist[] = { {.value = 0xE4, .at = 4}, {.value = 0x55, .at = 4} };
 
-void Receive(std::vector<uint8_t>& buffer)
+//Frame is already destuffed, valid until the function returns
+void Receive(const VEBus::FrameView& frame)
 {
-    _vEBus.DestuffingFAtoFF(buffer);
     Serial.printf("Res: ");
-    for (uint32_t j = 0; j < buffer.size(); j++) Serial.printf("%02X ", buffer[j]);
+    for (size_t j = 0; j < frame.size; j++) Serial.printf("%02X ", frame.data[j]);
     Serial.println();
 }
 
@@ -32,7 +32,7 @@ void setup()
 
     Serial.begin(256000);
 
-    _vEBus.SetReceiveCallback(Receive, _blacklist, sizeofarray(_blacklist));
+    _vEBus.SetFrameCallback(Receive, _blacklist, sizeofarray(_blacklist));
     _vEBus.SetLogLevel(VEBus::LogLevel::None);
     _vEBus.Setup();
 }
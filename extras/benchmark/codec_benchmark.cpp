@@ -0,0 +1,119 @@
+/*
+ Name:		codec_benchmark.cpp
+ Author:	nriedle
+
+ Host benchmark of VEBusFrameCodec against the former vector based stuffing.
+ Build and run on Linux:
+	g++ -O2 -std=gnu++11 -I../../src codec_benchmark.cpp ../../src/VEBusFrameCodec.cpp -o codec_benchmark
+	./codec_benchmark
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+#include "VEBusFrameCodec.h"
+
+#define ITERATIONS 200000
+
+struct Frame
+{
+	const char* name;
+	std::vector<uint8_t> bytes;
+};
+
+//Frames as decoded by the library (captured on a Multiplus-II 12/3000)
+static std::vector<Frame> capturedFrames()
+{
+	return {
+		{ "sync", { 0x83, 0x83, 0xFD, 0x42, 0x55, 0x00, 0x00, 0x00, 0xB5, 0xFF } },
+		{ "ac info", { 0x83, 0x83, 0xFE, 0x1B, 0x20, 0x01, 0x01, 0x00, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0xC6, 0x59, 0x1E, 0x00, 0x00, 0x7D, 0xFF } },
+		{ "dc info", { 0x83, 0x83, 0xFE, 0x72, 0x20, 0x40, 0xA5, 0xC4, 0x01, 0x0C, 0x33, 0x05, 0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x86, 0xEB, 0xFF } },
+		{ "setting info", { 0x83, 0x83, 0xFE, 0x32, 0x00, 0x8D, 0x89, 0xBB, 0xFF } },
+		{ "write 0xFFFF", { 0x98, 0xF7, 0xFE, 0x01, 0x00, 0x80, 0x37, 0x02, 0x06, 0xFF, 0xFF } },
+		{ "read 6 vars", { 0x98, 0xF7, 0xFE, 0x01, 0x00, 0xFB, 0x30, 0x00, 0x01, 0x04, 0x05, 0x0E, 0x10 } },
+	};
+}
+
+//Former implementation (VEBus.cpp up to 1.0.6)
+static void legacyStuffing(std::vector<uint8_t>& buffer)
+{
+	for (uint8_t i = 4; i < buffer.size(); i++)
+	{
+		if (buffer[i] >= 0xFA)
+		{
+			buffer[i] = 0x70 | (buffer[i] & 0x0F);
+			buffer.insert(buffer.begin() + i, 0xFA);
+		}
+	}
+}
+
+static void legacyDestuffing(std::vector<uint8_t>& buffer)
+{
+	for (uint8_t i = 4; i < buffer.size(); i++)
+	{
+		if (buffer[i] == 0xFA && i != buffer.size() - 1)
+		{
+			buffer[i] = buffer[i + 1] + 0x80;
+			buffer.erase(buffer.begin() + i + 1);
+		}
+	}
+}
+
+template <typename F>
+static double nsPerOp(F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ITERATIONS; i++) f();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / ITERATIONS;
+}
+
+static volatile size_t sink;
+
+int main()
+{
+	bool ok = true;
+	printf("%-14s %5s %14s %14s %14s %14s\n", "frame", "len", "legacy stuff", "codec stuff", "legacy destuff", "codec destuff");
+
+	for (auto& frame : capturedFrames())
+	{
+		std::vector<uint8_t> stuffed = frame.bytes;
+		legacyStuffing(stuffed);
+
+		uint8_t out[512];
+		size_t length = VEBusFrameCodec::Stuff(frame.bytes.data(), frame.bytes.size(), out, sizeof(out));
+		ok &= std::vector<uint8_t>(out, out + length) == stuffed;
+		length = VEBusFrameCodec::Destuff(stuffed.data(), stuffed.size(), out, sizeof(out));
+		std::vector<uint8_t> destuffed = stuffed;
+		legacyDestuffing(destuffed);
+		ok &= std::vector<uint8_t>(out, out + length) == destuffed;
+
+		double legacyStuff = nsPerOp([&]() { std::vector<uint8_t> buffer = frame.bytes; legacyStuffing(buffer); sink = buffer.size(); });
+		double codecStuff = nsPerOp([&]() { sink = VEBusFrameCodec::Stuff(frame.bytes.data(), frame.bytes.size(), out, sizeof(out)); });
+		double legacyDestuff = nsPerOp([&]() { std::vector<uint8_t> buffer = stuffed; legacyDestuffing(buffer); sink = buffer.size(); });
+		double codecDestuff = nsPerOp([&]() { sink = VEBusFrameCodec::Destuff(stuffed.data(), stuffed.size(), out, sizeof(out)); });
+
+		printf("%-14s %5zu %11.1f ns %11.1f ns %11.1f ns %11.1f ns\n", frame.name, frame.bytes.size(), legacyStuff, codecStuff, legacyDestuff, codecDestuff);
+	}
+
+	//Frames > 255 bytes never terminated with the former uint8_t index
+	std::vector<uint8_t> longFrame(600);
+	for (size_t i = 0; i < longFrame.size(); i++) longFrame[i] = (uint8_t)(i * 7);
+	std::vector<uint8_t> buffer(2 * longFrame.size());
+	size_t length = VEBusFrameCodec::Stuff(longFrame.data(), longFrame.size(), buffer.data(), buffer.size());
+	length = VEBusFrameCodec::Destuff(buffer.data(), length, buffer.data(), buffer.size());
+	ok &= std::vector<uint8_t>(buffer.begin(), buffer.begin() + length) == longFrame;
+
+	//In place stuffing
+	std::copy(longFrame.begin(), longFrame.end(), buffer.begin());
+	length = VEBusFrameCodec::Stuff(buffer.data(), longFrame.size(), buffer.data(), buffer.size());
+	length = VEBusFrameCodec::Destuff(buffer.data(), length, buffer.data(), buffer.size());
+	ok &= std::vector<uint8_t>(buffer.begin(), buffer.begin() + length) == longFrame;
+
+	double longStuff = nsPerOp([&]() { sink = VEBusFrameCodec::Stuff(longFrame.data(), longFrame.size(), buffer.data(), buffer.size()); });
+	printf("%-14s %5zu %14s %11.1f ns\n", "long frame", longFrame.size(), "-", longStuff);
+
+	printf("%s\n", ok ? "codec output matches" : "CODEC OUTPUT MISMATCH");
+	return ok ? 0 : 1;
+}
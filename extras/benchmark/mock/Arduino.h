@@ -0,0 +1,155 @@
+// Arduino.h
+// Host mock of the Arduino, FreeRTOS and ESP-IDF functions used by the library.
+// Time only moves with Mock::Advance(), tasks are never started, semaphores and notifications do nothing.
+
+#ifndef _MOCK_ARDUINO_h
+#define _MOCK_ARDUINO_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <functional>
+
+namespace Mock
+{
+    struct Counters
+    {
+        uint64_t allocations;
+        uint64_t allocatedBytes;
+        uint64_t copiedBytes;       //memcpy, memmove and copies of VEBus::Data, see Mock.cpp
+        uint64_t txBytes;
+    };
+
+    extern Counters counters;
+
+    void Advance(uint32_t us);
+    void* Allocate(size_t bytes);
+
+    //Bytes returned by the next HardwareSerial::read() calls
+    void Receive(const uint8_t* data, size_t size);
+}
+
+//FreeRTOS
+typedef void* SemaphoreHandle_t;
+typedef void* TaskHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) (ms)
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return (SemaphoreHandle_t)1; }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+inline void vSemaphoreDelete(SemaphoreHandle_t) {}
+inline BaseType_t xTaskCreatePinnedToCore(void (*)(void*), const char*, uint32_t, void*, UBaseType_t, TaskHandle_t* task, BaseType_t)
+{
+    if (task != NULL) *task = NULL;
+    return pdPASS;
+}
+inline void vTaskDelete(TaskHandle_t) {}
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return (TaskHandle_t)1; }
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 0; }
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+
+//ESP-IDF
+typedef int esp_err_t;
+typedef int uart_port_t;
+typedef int esp_sleep_wakeup_cause_t;
+#define ESP_OK 0
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define UART_NUM_0 0
+#define UART_NUM_1 1
+#define UART_NUM_2 2
+#define SOC_UART_NUM 3
+#define ESP_SLEEP_WAKEUP_ALL 0
+#define ESP_SLEEP_WAKEUP_UART 8
+
+inline void* heap_caps_malloc(size_t bytes, uint32_t) { return Mock::Allocate(bytes); }
+inline void heap_caps_free(void* p) { free(p); }
+inline bool esp_ptr_external_ram(const void*) { return false; }
+inline uint32_t esp_get_free_heap_size() { return 0; }
+inline uint32_t esp_get_minimum_free_heap_size() { return 0; }
+inline esp_err_t uart_set_wakeup_threshold(uart_port_t, int) { return ESP_OK; }
+inline esp_err_t esp_sleep_enable_uart_wakeup(int) { return ESP_OK; }
+inline esp_err_t esp_sleep_enable_timer_wakeup(uint64_t) { return ESP_OK; }
+inline esp_err_t esp_sleep_disable_wakeup_source(int) { return ESP_OK; }
+inline esp_err_t esp_light_sleep_start() { return ESP_OK; }
+inline esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause() { return 0; }
+
+//Arduino
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define SERIAL_8N1 0x800001c
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+
+enum hardwareSerial_error_t
+{
+    UART_NO_ERROR,
+    UART_BREAK_ERROR,
+    UART_BUFFER_FULL_ERROR,
+    UART_FIFO_OVF_ERROR,
+    UART_FRAME_ERROR,
+    UART_PARITY_ERROR
+};
+
+class Print
+{
+public:
+    size_t print(const char* text) { return printf("%s", text); }
+    size_t println(const char* text = "") { return printf("%s\n", text); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        va_list args;
+        va_start(args, format);
+        int length = vprintf(format, args);
+        va_end(args);
+        return length;
+    }
+    size_t write(const uint8_t*, size_t size)
+    {
+        Mock::counters.txBytes += size;
+        return size;
+    }
+    size_t write(uint8_t value) { return write(&value, 1); }
+};
+
+//Reads the bytes of Mock::Receive(), written bytes are only counted
+class HardwareSerial : public Print
+{
+public:
+    void begin(unsigned long, uint32_t = SERIAL_8N1, int8_t = -1, int8_t = -1) {}
+    bool setPins(int8_t, int8_t, int8_t, int8_t) { return true; }
+    bool setMode(int) { return true; }
+    size_t setRxBufferSize(size_t size) { return size; }
+    bool setRxTimeout(uint8_t) { return true; }
+    void onReceive(std::function<void(void)>, bool = true) {}
+    void onReceiveError(std::function<void(hardwareSerial_error_t)>) {}
+    void flush(bool = true) {}
+    int available();
+    int read();
+    size_t read(uint8_t* buffer, size_t size);
+    size_t read(char* buffer, size_t size) { return read((uint8_t*)buffer, size); }
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ Name:		Mock.cpp
+ Author:	nriedle
+
+ Host mock of time, serial and heap. Every operator new and heap_caps_malloc is counted.
+ memcpy and memmove are counted when linked with -Wl,--wrap=memcpy -Wl,--wrap=memmove.
+*/
+
+#include "Arduino.h"
+#include <new>
+
+namespace Mock
+{
+	Counters counters = {};
+
+	static uint64_t timeUs = 1000000;
+	static const uint8_t* rxData = nullptr;
+	static size_t rxSize = 0;
+
+	void Advance(uint32_t us)
+	{
+		timeUs += us;
+	}
+
+	void* Allocate(size_t bytes)
+	{
+		counters.allocations++;
+		counters.allocatedBytes += bytes;
+		return malloc(bytes);
+	}
+
+	void Receive(const uint8_t* data, size_t size)
+	{
+		rxData = data;
+		rxSize = size;
+	}
+}
+
+unsigned long millis()
+{
+	return (unsigned long)(Mock::timeUs / 1000);
+}
+
+unsigned long micros()
+{
+	return (unsigned long)Mock::timeUs;
+}
+
+void delay(unsigned long ms)
+{
+	Mock::Advance(ms * 1000);
+}
+
+int HardwareSerial::available()
+{
+	return (int)Mock::rxSize;
+}
+
+int HardwareSerial::read()
+{
+	uint8_t value;
+	return (read(&value, 1) == 1) ? value : -1;
+}
+
+size_t HardwareSerial::read(uint8_t* buffer, size_t size)
+{
+	if (size > Mock::rxSize) size = Mock::rxSize;
+	memcpy(buffer, Mock::rxData, size);
+	Mock::rxData += size;
+	Mock::rxSize -= size;
+	return size;
+}
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+HardwareSerial Serial2;
+
+void* operator new(size_t size)
+{
+	void* p = Mock::Allocate(size);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
+
+//VEBUS_COUNT_COPIES, a copy of VEBus::Data counts its size. Without VEBUS_NO_HEAP the
+//request and response buffers are copied with memmove and counted there.
+void VEBusCountCopy(size_t bytes)
+{
+	Mock::counters.copiedBytes += bytes;
+}
+
+extern "C"
+{
+	void* __real_memcpy(void* dst, const void* src, size_t size);
+	void* __real_memmove(void* dst, const void* src, size_t size);
+
+	void* __wrap_memcpy(void* dst, const void* src, size_t size)
+	{
+		Mock::counters.copiedBytes += size;
+		return __real_memcpy(dst, src, size);
+	}
+
+	void* __wrap_memmove(void* dst, const void* src, size_t size)
+	{
+		Mock::counters.copiedBytes += size;
+		return __real_memmove(dst, src, size);
+	}
+}
@@ -0,0 +1,4 @@
+// arduino.h
+// The library includes the lower case name
+
+#include "Arduino.h"
@@ -0,0 +1,4 @@
+// uart.h
+// Declared in Arduino.h
+
+#include "Arduino.h"
@@ -0,0 +1,4 @@
+// esp_heap_caps.h
+// Declared in Arduino.h
+
+#include "Arduino.h"
@@ -0,0 +1,4 @@
+// esp_memory_utils.h
+// Declared in Arduino.h
+
+#include "Arduino.h"
@@ -0,0 +1,4 @@
+// esp_sleep.h
+// Declared in Arduino.h
+
+#include "Arduino.h"
@@ -0,0 +1,8 @@
+// uart_types.h
+
+#ifndef _MOCK_UART_TYPES_h
+#define _MOCK_UART_TYPES_h
+
+#define UART_MODE_RS485_HALF_DUPLEX 1
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ Name:		vebus_benchmark.cpp
+ Author:	nriedle
+
+ Host benchmark of the library hot paths: byte stuffing, frame decoding, request fifo, ID allocation,
+ response handling and value conversions. Runs against the mocks in mock/ (no tasks, time stands still).
+ Reports ns/op, heap allocations per op and bytes copied per op. Copies are counted in memcpy/memmove and,
+ with VEBUS_COUNT_COPIES, as sizeof(VEBus::Data) per copy of a request. Data is copied member by member,
+ memcpy does not see it. Copies of other structs (frames, ResponseData) are not counted.
+ Build and run on Linux:
+	g++ -O2 -std=gnu++11 -DVEBUS_COUNT_COPIES -fno-builtin-memcpy -fno-builtin-memmove -Imock -I../../src vebus_benchmark.cpp mock/Mock.cpp ../../src/VEBus.cpp ../../src/VEBusFrameCodec.cpp ../../src/VEBusHistory.cpp ../../src/VEBusHistogram.cpp -Wl,--wrap=memcpy -Wl,--wrap=memmove -o vebus_benchmark
+	./vebus_benchmark --compare baseline.txt
+ Add -DVEBUS_NO_HEAP and compare with baseline_no_heap.txt for the heap-free build.
+ --save <file> writes the results as new baseline. --compare <file> fails if a benchmark allocates or
+ copies more than in the baseline, ns/op are only comparable on the same machine and are not checked.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "VEBus.h"
+
+#define ITERATIONS 200000
+
+struct Result
+{
+	std::string name;
+	double ns;
+	double allocations;
+	double copiedBytes;
+};
+
+struct Frame
+{
+	const char* name;
+	std::vector<uint8_t> bytes;
+};
+
+static std::vector<Result> results;
+static volatile uint32_t sink;
+
+//Frames as decoded by the library, one per frame type
+static std::vector<Frame> capturedFrames()
+{
+	return {
+		{ "sync", { 0x83, 0x83, 0xFD, 0x42, 0x55, 0x00, 0x00, 0x00, 0xB5, 0xFF } },
+		{ "ac info", { 0x83, 0x83, 0xFE, 0x1B, 0x20, 0x01, 0x01, 0x00, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0xC6, 0x59, 0x1E, 0x00, 0x00, 0x7D, 0xFF } },
+		{ "dc info", { 0x83, 0x83, 0xFE, 0x72, 0x20, 0x40, 0xA5, 0xC4, 0x01, 0x0C, 0x33, 0x05, 0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x86, 0xEB, 0xFF } },
+		{ "master led", { 0x83, 0x83, 0xFE, 0x2A, 0x41, 0x10, 0x09, 0x00, 0x00, 0x01, 0x32, 0x00, 0xF4, 0x01, 0xA0, 0x00, 0x01, 0x5E, 0xFF } },
+		{ "battery", { 0x83, 0x83, 0xFE, 0x53, 0x70, 0x81, 0x64, 0x14, 0xBC, 0x02, 0xC8, 0x00, 0x00, 0x2F, 0xFF } },
+		{ "charger", { 0x83, 0x83, 0xFE, 0x60, 0x80, 0x80, 0x13, 0x00, 0x80, 0x00, 0x00, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x5C, 0xFF } },
+		{ "response", { 0x83, 0x83, 0xFE, 0x12, 0x00, 0x42, 0x85, 0xF2, 0x04, 0x00, 0xFF } },
+		{ "setting info", { 0x83, 0x83, 0xFE, 0x32, 0x00, 0x8D, 0x89, 0xBB, 0xFF } },
+		{ "write 0xFFFF", { 0x98, 0xF7, 0xFE, 0x01, 0x00, 0x80, 0x37, 0x02, 0x06, 0xFF, 0xFF } },
+	};
+}
+
+static void printResult(const Result& result)
+{
+	printf("%-36s %10.1f %10.2f %10.1f\n", result.name.c_str(), result.ns, result.allocations, result.copiedBytes);
+}
+
+//prepare is neither timed nor counted, run does count operations
+template <typename P, typename R>
+static void measure(const std::string& name, uint32_t steps, uint32_t count, P prepare, R run)
+{
+	prepare();
+	run();
+
+	std::chrono::steady_clock::duration elapsed(0);
+	uint64_t allocations = 0;
+	uint64_t copiedBytes = 0;
+	for (uint32_t i = 0; i < steps; i++)
+	{
+		prepare();
+		Mock::Counters before = Mock::counters;
+		auto start = std::chrono::steady_clock::now();
+		run();
+		elapsed += std::chrono::steady_clock::now() - start;
+		allocations += Mock::counters.allocations - before.allocations;
+		copiedBytes += Mock::counters.copiedBytes - before.copiedBytes;
+	}
+
+	double ops = (double)steps * count;
+	Result result = { name, std::chrono::duration<double, std::nano>(elapsed).count() / ops, allocations / ops, copiedBytes / ops };
+	results.push_back(result);
+	printResult(result);
+}
+
+template <typename R>
+static void measure(const std::string& name, R run)
+{
+	measure(name, 1, ITERATIONS, []() {}, [&]() { for (uint32_t i = 0; i < ITERATIONS; i++) run(i); });
+}
+
+class VEBusBenchmark
+{
+public:
+	static void Codec()
+	{
+		VEBus* bus = new VEBus(Serial1, -1, -1, -1);
+		for (auto& frame : capturedFrames())
+		{
+			VEBus::Buffer raw;
+			for (uint8_t value : frame.bytes) raw.push_back(value);
+			VEBus::Buffer stuffed = raw;
+			bus->stuffingFAtoFF(stuffed);
+			VEBus::Buffer buffer;
+			buffer.reserve(VEBUS_MAX_FRAME_SIZE);
+
+			measure(std::string("stuffingFAtoFF ") + frame.name, [&](uint32_t) { buffer = raw; bus->stuffingFAtoFF(buffer); sink = buffer.size(); });
+			measure(std::string("DestuffingFAtoFF ") + frame.name, [&](uint32_t) { buffer = stuffed; bus->DestuffingFAtoFF(buffer); sink = buffer.size(); });
+
+			//Same as sendStagedFrame, the frame without checksum and end of frame
+			uint8_t txFrame[VEBUS_MAX_FRAME_SIZE + 3];
+			size_t length = stuffed.size() - 2;
+			memcpy(txFrame, stuffed.data(), length);
+			measure(std::string("AppendChecksum ") + frame.name, [&](uint32_t) { sink = VEBusFrameCodec::AppendChecksum(txFrame, length, sizeof(txFrame)); });
+		}
+		delete bus;
+	}
+
+	static void Decode()
+	{
+		VEBus* bus = new VEBus(Serial1, -1, -1, -1);
+		for (auto& frame : capturedFrames())
+		{
+			VEBus::Buffer buffer;
+			for (uint8_t value : frame.bytes) buffer.push_back(value);
+			measure(std::string("decodeVEbusFrame ") + frame.name, [&](uint32_t) { sink = bus->decodeVEbusFrame(buffer); });
+		}
+		delete bus;
+	}
+
+	//Writes merged into the last entry, the fifo is searched from the front
+	static void Fifo()
+	{
+		const uint8_t depths[] = { 1, 16, 32, VEBUS_REQUEST_POOL_SIZE - 1 };
+		for (uint8_t depth : depths)
+		{
+			VEBus* bus = new VEBus(Serial1, -1, -1, -1);
+			for (uint8_t i = 0; i < depth; i++) bus->addOrUpdateFifo(writeRequest(*bus, i));
+			bus->drainSubmissions();
+			VEBus::Data data = bus->_dataFifo.back();
+			measure(std::string("addOrUpdateFifo depth ") + std::to_string(depth), [&](uint32_t) { bus->addOrUpdateFifo(data); bus->drainSubmissions(); });
+			delete bus;
+		}
+	}
+
+	static void Ids()
+	{
+		const uint8_t used[] = { 0, 32, 64, 120 };
+		for (uint8_t count : used)
+		{
+			VEBus* bus = new VEBus(Serial1, -1, -1, -1);
+			uint8_t id;
+			for (uint8_t i = 0; i < count; i++) bus->getNextFreeId_1(id);
+			measure(std::string("getNextFreeId_1 used ") + std::to_string(count), [&](uint32_t) { bus->getNextFreeId_1(id); bus->releaseId(id); sink = id; });
+			delete bus;
+		}
+	}
+
+	//One batch fills the completion queue, checkResponseMessage() delivers it
+	static void Responses()
+	{
+		VEBus* bus = new VEBus(Serial1, -1, -1, -1);
+		bus->SetResponseCallback([](VEBus::ResponseData& response) { sink = response.id; });
+		VEBus::Data data;
+		data.id = 0x85;
+		data.responseExpected = true;
+		data.command = WinmonCommand::ReadRAMVar;
+		data.address = RamVariables::UBat;
+		const uint8_t response[] = { 0x83, 0x83, 0xFE, 0x12, 0x00, 0x85, 0x85, 0xF2, 0x04, 0x00, 0xFF };
+		for (uint8_t value : response) data.responseData.push_back(value);
+
+		measure("checkResponseMessage", 1000, VEBUS_COMPLETION_DEPTH,
+			[&]() { for (uint32_t i = 0; i < VEBUS_COMPLETION_DEPTH; i++) bus->_completionQueue.push(data); },
+			[&]() { while (bus->checkResponseMessage()); });
+		delete bus;
+	}
+
+	static void Conversions()
+	{
+		VEBus* bus = new VEBus(Serial1, -1, -1, -1);
+		measure("convertRamVarToValue", [&](uint32_t i) { sink = bus->convertRamVarToValue(RamVariables::UBat, (uint16_t)i); });
+		measure("convertRamVarToValueSigned", [&](uint32_t i) { sink = bus->convertRamVarToValueSigned(RamVariables::IBat, (int16_t)i); });
+		measure("convertRamVarToRawValue", [&](uint32_t i) { sink = bus->convertRamVarToRawValue(RamVariables::UBat, (i & 0xFF) / 10.0f); });
+		measure("convertRamVarToRawValueSigned", [&](uint32_t i) { sink = bus->convertRamVarToRawValueSigned(RamVariables::IBat, (i & 0xFF) / 10.0f); });
+		measure("convertSettingToValue", [&](uint32_t i) { sink = bus->convertSettingToValue(Settings::IMainsLimit, (uint16_t)i); });
+		measure("convertSettingToRawValue", [&](uint32_t i) { sink = bus->convertSettingToRawValue(Settings::IMainsLimit, (i & 0xFF) / 10.0f); });
+		delete bus;
+	}
+
+private:
+	static VEBus::Data writeRequest(VEBus& bus, uint8_t address)
+	{
+		VEBus::Data data;
+		bus.getNextFreeId_1(data.id);
+		data.responseExpected = true;
+		data.command = WinmonCommand::WriteSetting;
+		data.address = address;
+		data.expectedResponseCode = 0x88;
+		bus.prepareCommandWriteViaID(data.requestData, data.id, data.command, address, (uint16_t)0, StorageType::NoEeprom);
+		return data;
+	}
+};
+
+static bool save(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == nullptr) return false;
+	fprintf(file, "#name\tns/op\tallocs/op\tbytes copied/op\n");
+	fprintf(file, "#bytes copied: memcpy/memmove and sizeof(VEBus::Data) per request copy, other struct copies are not counted\n");
+	for (auto& result : results) fprintf(file, "%s\t%.1f\t%.2f\t%.1f\n", result.name.c_str(), result.ns, result.allocations, result.copiedBytes);
+	fclose(file);
+	return true;
+}
+
+//Returns false if a benchmark allocates or copies more than in the baseline
+static bool compare(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (file == nullptr)
+	{
+		printf("baseline %s not found\n", path);
+		return false;
+	}
+
+	bool ok = true;
+	char line[256];
+	printf("\n%-36s %10s %10s %10s\n", "compared to baseline", "ns/op", "allocs/op", "copied/op");
+	while (fgets(line, sizeof(line), file) != nullptr)
+	{
+		char name[128];
+		Result baseline;
+		if ((line[0] == '#') || (sscanf(line, "%127[^\t]\t%lf\t%lf\t%lf", name, &baseline.ns, &baseline.allocations, &baseline.copiedBytes) != 4)) continue;
+		for (auto& result : results)
+		{
+			if (result.name != name) continue;
+			bool worse = (result.allocations > baseline.allocations + 0.005) || (result.copiedBytes > baseline.copiedBytes + 0.05);
+			printf("%-36s %+9.0f%% %+10.2f %+10.1f%s\n", name, (result.ns / baseline.ns - 1) * 100,
+				result.allocations - baseline.allocations, result.copiedBytes - baseline.copiedBytes, worse ? "  REGRESSION" : "");
+			ok &= !worse;
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	printf("%-36s %10s %10s %10s\n", "benchmark", "ns/op", "allocs/op", "copied/op");
+	VEBusBenchmark::Codec();
+	VEBusBenchmark::Decode();
+	VEBusBenchmark::Fifo();
+	VEBusBenchmark::Ids();
+	VEBusBenchmark::Responses();
+	VEBusBenchmark::Conversions();
+
+	bool ok = true;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "--save") == 0) ok &= save(argv[i + 1]);
+		else if (strcmp(argv[i], "--compare") == 0) ok &= compare(argv[i + 1]);
+	}
+	return ok ? 0 : 1;
+}
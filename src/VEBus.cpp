@@ -5,8 +5,10 @@
 */
 
 #include "VEBus.h"
+#include "esp_sleep.h"
+#include "driver/uart.h"
 
-#define NEXT_FRAME_NR(x) (x + 1) & 0x7F
+#define NEXT_FRAME_NR(x) (((x) + 1) & 0x7F)
 #define MK3_ID_0 0x98 //8F?
 #define MK3_ID_1 0xF7
 #define MP_ID_0 0x83
@@ -20,9 +22,47 @@
 #define VEBUS_BAUD 256000
 
 #define RESPONSE_TIMEOUT 10000
+#define GARBAGE_COLLECTOR_INTERVAL 100
 #define MAX_RESEND 2
+#define MAX_SNAPSHOT_SIZE 6
+#define MAX_AGGREGATE_WINDOWS 3
 
-//Runs on core 0
+static_assert((VEBUS_RX_QUEUE_DEPTH & (VEBUS_RX_QUEUE_DEPTH - 1)) == 0, "VEBUS_RX_QUEUE_DEPTH must be a power of two");
+static_assert((VEBUS_INFLIGHT_INDEX_SIZE & (VEBUS_INFLIGHT_INDEX_SIZE - 1)) == 0, "VEBUS_INFLIGHT_INDEX_SIZE must be a power of two");
+static_assert(VEBUS_INFLIGHT_INDEX_SIZE > VEBUS_REQUEST_POOL_SIZE, "VEBUS_INFLIGHT_INDEX_SIZE must be above VEBUS_REQUEST_POOL_SIZE");
+
+#ifdef VEBUS_COUNT_ALLOCATIONS
+static std::atomic<uint32_t> allocationCount(0);
+
+void* operator new(size_t size)
+{
+	allocationCount++;
+	return malloc(size);
+}
+
+void* operator new[](size_t size)
+{
+	allocationCount++;
+	return malloc(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	free(ptr);
+}
+
+uint32_t VEBus::GetAllocationCount()
+{
+	return allocationCount;
+}
+#endif
+
+//Real-time task on core 0: framing, sync and sending the staged request
 void communication_task(void* handler_args)
 {
 	auto mk3Instance = static_cast<VEBus*>(handler_args);
@@ -30,9 +70,36 @@ void communication_task(void* handler_args)
 	while (true)
 	{
 		mk3Instance->commandHandling();
-		//vTaskDelay(1 / portTICK_RATE_MS);
-		taskYIELD();
+		//Woken by the UART at the end of every frame
+		ulTaskNotifyTake(pdTRUE, 1);
+	}
+}
+
+//Decoding, request fifo and staging of the next request, woken by the real-time task and new requests
+void decode_task(void* handler_args)
+{
+	auto instance = static_cast<VEBus*>(handler_args);
+
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(GARBAGE_COLLECTOR_INTERVAL));
+		instance->decodeHandling();
+	}
+}
+
+//Runs Maintain() when woken by the decode task, at least every GARBAGE_COLLECTOR_INTERVAL
+void dispatcher_task(void* handler_args)
+{
+	auto instance = static_cast<VEBus*>(handler_args);
+
+	while (instance->_dispatcherRunning)
+	{
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(GARBAGE_COLLECTOR_INTERVAL));
+		instance->Maintain();
 	}
+
+	instance->_dispatcherTask = NULL;
+	vTaskDelete(NULL);
 }
 
 VEBus::VEBus(HardwareSerial& serial, int8_t rxPin, int8_t txPin, int8_t rePin) :
@@ -41,17 +108,30 @@ VEBus::VEBus(HardwareSerial& serial, int8_t rxPin, int8_t txPin, int8_t rePin) :
 	_txPin(txPin),
 	_rePin(rePin)
 {
-	_semaphoreDataFifo = xSemaphoreCreateMutex();
+	_semaphoreCache = xSemaphoreCreateMutex();
 	_semaphoreStatus = xSemaphoreCreateMutex();
-	_semaphoreReceiveData = xSemaphoreCreateMutex();
-	SetReceiveCallback([this](std::vector<uint8_t>&) {});
-	SetResponseCallback([this](ResponseData&) {});
-	_dataFifo.reserve(10);
-	_receiveBufferList.reserve(10);
+	_onReceiveCb = [](Buffer&) {};
+	_onFrameCb = [](const FrameView&) {};
+	SetResponseCallback([](ResponseData&) {});
+	_onWatermarkCb = [](bool, uint32_t) {};
+	_dataFifo.reserve(VEBUS_REQUEST_POOL_SIZE);
+	memset(_ramVarObservers, NoObserver, sizeof(_ramVarObservers));
+	memset(_settingObservers, NoObserver, sizeof(_settingObservers));
 }
 
 VEBus::~VEBus()
 {
+	SetLatencyTracing(false);
+}
+
+void* VEBus::operator new(size_t size) noexcept
+{
+	return VEBusContainer::CapsAllocate(size, VEBUS_HOT_CAPS);
+}
+
+void VEBus::operator delete(void* p)
+{
+	heap_caps_free(p);
 }
 
 void VEBus::Setup(bool autostart)
@@ -68,22 +148,71 @@ void VEBus::Setup(bool autostart)
 #endif
 
 	if (autostart) StartCommunication();
-	xTaskCreatePinnedToCore(communication_task, "vebus_task", 4096, this, 0, NULL, 0);   //Priority 0, CPU 0
+	xTaskCreatePinnedToCore(decode_task, "vebus_decode", 4096, this, VEBUS_DECODE_PRIORITY, &_decodeTask, VEBUS_DECODE_CORE);
+	xTaskCreatePinnedToCore(communication_task, "vebus_task", 4096, this, VEBUS_TASK_PRIORITY, &_communicationTask, 0);
+	_serial.setRxTimeout(1);
+	_serial.onReceive([this]() {
+		TaskHandle_t task = _communicationTask;
+		if (task != NULL) xTaskNotifyGive(task);
+	});
+	_serial.onReceiveError([this](hardwareSerial_error_t error) {
+		if ((error == UART_FIFO_OVF_ERROR) || (error == UART_BUFFER_FULL_ERROR)) _counters.rxOverflows++;
+	});
 }
 
-void VEBus::Maintain()
+void VEBus::Maintain(uint32_t budgetUs)
 {
-	logging();
-	garbageCollector();
-	checkResponseMessage();
+	if ((_dispatcherTask != NULL) && (xTaskGetCurrentTaskHandle() != _dispatcherTask)) return;
+
+	uint32_t startUs = micros();
+	auto inBudget = [&]() { return (budgetUs == 0) || (micros() - startUs < budgetUs); };
 
-	xSemaphoreTake(_semaphoreReceiveData, portMAX_DELAY);
-	while (!_receiveBufferList.empty())
+	logging();
+	if (_watermarkChanged.exchange(false)) _onWatermarkCb(_aboveHighWatermark, GetFifoSize());
+	while (checkResponseMessage() && inBudget());
+	callHarvestedValues();
+
+	//The callbacks read the ring slot, it is recycled when they return
+	Buffer buffer;
+	FrameView view;
+	while (inBudget() && borrowFrame(view))
 	{
-		_onReceiveCb(_receiveBufferList.front());
-		_receiveBufferList.erase(_receiveBufferList.begin());
+		if (_receiveMode == ReceiveMode::ReceiveView) _onFrameCb(view);
+		else
+		{
+			buffer.resize(view.size);
+			memcpy(buffer.data(), view.data, view.size);
+			_onReceiveCb(buffer);
+		}
+		releaseFrame();
 	}
-	xSemaphoreGive(_semaphoreReceiveData);
+
+	printLog();
+}
+
+bool VEBus::StartDispatcher(uint8_t priority, uint32_t stackSize, int8_t core)
+{
+	if (_dispatcherTask != NULL) return false;
+	_dispatcherRunning = true;
+	if (xTaskCreatePinnedToCore(dispatcher_task, "vebus_dispatcher", stackSize, this, priority, &_dispatcherTask, core) == pdPASS) return true;
+	_dispatcherRunning = false;
+	_dispatcherTask = NULL;
+	return false;
+}
+
+void VEBus::StopDispatcher()
+{
+	TaskHandle_t task = _dispatcherTask;
+	if (task == NULL) return;
+	_dispatcherRunning = false;
+	xTaskNotifyGive(task);
+}
+
+//Decode task
+void VEBus::notifyDispatcher()
+{
+	TaskHandle_t task = _dispatcherTask;
+	if (task != NULL) xTaskNotifyGive(task);
 }
 
 void VEBus::SetLogLevel(LogLevel level)
@@ -96,30 +225,64 @@ VEBus::LogLevel VEBus::GetLogLevel()
 	return _logLevel;
 }
 
-void VEBus::SetResponseCallback(std::function<void(ResponseData&)> cb)
+void VEBus::SetLogCallback(LogCallback cb)
+{
+	_onLogCb = cb;
+}
+
+void VEBus::SetResponseCallback(ResponseCallback cb)
 {
 	_onResponseCb = cb;
 }
 
-void VEBus::SetReceiveCallback(std::function<void(std::vector<uint8_t>&)> cb)
+void VEBus::SetReceiveCallback(ReceiveCallback cb)
 {
 	_onReceiveCb = cb;
+	_receiveMode = ReceiveMode::ReceiveBuffer;
+}
+
+void VEBus::SetReceiveCallback(ReceiveCallback cb, Blacklist* blacklist, size_t size)
+{
+	setBlacklist(blacklist, size);
+	SetReceiveCallback(cb);
+}
+
+void VEBus::SetReceiveCallback(ReceiveCallback cb, Whitelist* whitelist, size_t size)
+{
+	setWhitelist(whitelist, size);
+	SetReceiveCallback(cb);
+}
+
+void VEBus::SetFrameCallback(FrameCallback cb)
+{
+	_onFrameCb = cb;
+	_receiveMode = ReceiveMode::ReceiveView;
+}
+
+void VEBus::SetFrameCallback(FrameCallback cb, Blacklist* blacklist, size_t size)
+{
+	setBlacklist(blacklist, size);
+	SetFrameCallback(cb);
+}
+
+void VEBus::SetFrameCallback(FrameCallback cb, Whitelist* whitelist, size_t size)
+{
+	setWhitelist(whitelist, size);
+	SetFrameCallback(cb);
 }
 
-void VEBus::SetReceiveCallback(std::function<void(std::vector<uint8_t>&)> cb, Blacklist* blacklist, size_t size)
+void VEBus::setBlacklist(Blacklist* blacklist, size_t size)
 {
 	if (size > 20) size = 20;
 	for (size_t i = 0; i < size; i++) _blacklist[i] = blacklist[i];
 	_blacklistSize = size;
-	_onReceiveCb = cb;
 }
 
-void VEBus::SetReceiveCallback(std::function<void(std::vector<uint8_t>&)> cb, Whitelist* whitelist, size_t size)
+void VEBus::setWhitelist(Whitelist* whitelist, size_t size)
 {
 	if (size > 20) size = 20;
 	for (size_t i = 0; i < size; i++) _whitelist[i] = whitelist[i];
 	_whitelistSize = size;
-	_onReceiveCb = cb;
 }
 
 void VEBus::StartCommunication()
@@ -134,162 +297,455 @@ void VEBus::StopCommunication()
 	_communitationIsRunning = false;
 }
 
+bool VEBus::WaitForBusGap(uint32_t timeoutMs)
+{
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	if (!_communitationIsRunning || (task == _communicationTask) || (task == _decodeTask)) return false;
+
+	//A notification left from an earlier timeout is dropped before registering
+	ulTaskNotifyTake(pdTRUE, 0);
+	TaskHandle_t expected = NULL;
+	if (!_gapWaiter.compare_exchange_strong(expected, task)) return false;
+	if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMs)) != 0) return true;
+
+	//The real-time task took the waiter in the meantime, the sync was served
+	expected = task;
+	return !_gapWaiter.compare_exchange_strong(expected, NULL);
+}
+
+void VEBus::StartMonitoring(uint32_t intervalMs, uint32_t frameTypes, uint32_t maxListenMs)
+{
+	_monitorIntervalMs = intervalMs;
+	_monitorFrameTypes = frameTypes;
+	_monitorMaxListenMs = maxListenMs;
+	_monitorWakeMs = millis();
+	_receivedFrameTypes = 0;
+	_monitoring = true;
+}
+
+void VEBus::StopMonitoring()
+{
+	_monitoring = false;
+}
+
+VEBus::MonitoringStats VEBus::GetMonitoringStats()
+{
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	MonitoringStats stats = _monitoringStats;
+	xSemaphoreGive(_semaphoreStatus);
+	uint32_t totalMs = stats.awakeMs + stats.sleepMs;
+	stats.dutyCycle = (totalMs == 0) ? 100.0f : (float)stats.awakeMs * 100.0f / totalMs;
+	return stats;
+}
+
 uint32_t VEBus::GetFifoSize()
 {
-	return _dataFifo.size();
+	return _fifoSize + _submitQueue.size();
+}
+
+uint32_t VEBus::GetFifoCapacity()
+{
+	return VEBUS_REQUEST_POOL_SIZE;
+}
+
+void VEBus::SetFifoWatermarks(uint32_t high, uint32_t low, WatermarkCallback cb)
+{
+	_onWatermarkCb = cb;
+	_lowWatermark = (low < high) ? low : 0;
+	_highWatermark = high;
+}
+
+void VEBus::SetSubmitTimeout(uint32_t timeoutMs)
+{
+	_submitTimeoutMs = timeoutMs;
+}
+
+void VEBus::SetOverflowPolicy(OverflowPolicy policy)
+{
+	_overflowPolicy = policy;
+}
+
+void VEBus::SetBusBudget(uint8_t slotShare, uint32_t bytesPerSecond, uint8_t maxUtilization)
+{
+	_budgetSlotShare = (slotShare > 100) ? 100 : slotShare;
+	_budgetBytesPerSecond = bytesPerSecond;
+	_budgetMaxUtilization = maxUtilization;
+}
+
+void VEBus::SetPassiveHarvesting(bool enabled)
+{
+	_harvestingEnabled = enabled;
+}
+
+VEBus::Statistics VEBus::GetStats()
+{
+	Statistics stats;
+	for (uint8_t i = 0; i < FrameType::SizeOfFrameTypes; i++) stats.frames[i] = _counters.frames[i];
+	stats.txFrames = _counters.txFrames;
+	stats.txBytes = _counters.txBytes;
+	stats.rxBytes = _counters.rxBytes;
+	stats.bytesPerSecond = _counters.bytesPerSecond;
+	stats.busUtilization = _counters.busUtilization;
+	stats.ownSlotShare = _counters.ownSlotShare;
+	stats.throttled = _counters.throttled;
+	stats.sequenceGaps = _counters.sequenceGaps;
+	stats.rxDrops = _counters.rxDrops;
+	stats.rxOverflows = _counters.rxOverflows;
+	stats.requestQueueDepth = _fifoSize + _submitQueue.size();
+	stats.requestQueueHighWater = _counters.requestQueueHighWater;
+	stats.resends = _counters.resends;
+	stats.timeouts = _counters.timeouts;
+	stats.tooLate = _counters.tooLate;
+	stats.stackHighWaterMark = (_communicationTask != NULL) ? uxTaskGetStackHighWaterMark(_communicationTask) : 0;
+	stats.heapFree = esp_get_free_heap_size();
+	stats.heapMinimumFree = esp_get_minimum_free_heap_size();
+	stats.logDrops = _counters.logDrops;
+	stats.requestsDropped = _counters.requestsDropped;
+	stats.requestsShared = _counters.requestsShared;
+	return stats;
+}
+
+size_t VEBus::GetStatsPrometheus(char* buffer, size_t size)
+{
+	static const char* frameTypeNames[FrameType::SizeOfFrameTypes] = { "sync", "winmon", "info", "led", "battery", "charger_inverter", "phase", "master", "other" };
+	Statistics stats = GetStats();
+	size_t length = 0;
+	if (size > 0) buffer[0] = 0;
+
+	auto append = [&](const char* format, const char* name, const char* type, unsigned long value) {
+		if (length >= size) return;
+		int written = snprintf(buffer + length, size - length, format, name, type, value);
+		if (written > 0) length += written;
+	};
+	auto metric = [&](const char* name, const char* type, uint32_t value) {
+		append("# TYPE %s %s\n", name, type, 0);
+		append("%s%s %lu\n", name, "", value);
+	};
+
+	append("# TYPE %s %s\n", "vebus_frames_total", "counter", 0);
+	for (uint8_t i = 0; i < FrameType::SizeOfFrameTypes; i++) append("%s{type=\"%s\"} %lu\n", "vebus_frames_total", frameTypeNames[i], stats.frames[i]);
+	metric("vebus_tx_frames_total", "counter", stats.txFrames);
+	metric("vebus_tx_bytes_total", "counter", stats.txBytes);
+	metric("vebus_rx_bytes_total", "counter", stats.rxBytes);
+	metric("vebus_bytes_per_second", "gauge", stats.bytesPerSecond);
+	metric("vebus_bus_utilization_percent", "gauge", stats.busUtilization);
+	metric("vebus_own_slot_share_percent", "gauge", stats.ownSlotShare);
+	metric("vebus_throttled_total", "counter", stats.throttled);
+	metric("vebus_sequence_gaps_total", "counter", stats.sequenceGaps);
+	metric("vebus_rx_drops_total", "counter", stats.rxDrops);
+	metric("vebus_rx_overflows_total", "counter", stats.rxOverflows);
+	metric("vebus_request_queue_depth", "gauge", stats.requestQueueDepth);
+	metric("vebus_request_queue_high_water", "gauge", stats.requestQueueHighWater);
+	metric("vebus_resends_total", "counter", stats.resends);
+	metric("vebus_timeouts_total", "counter", stats.timeouts);
+	metric("vebus_too_late_total", "counter", stats.tooLate);
+	metric("vebus_task_stack_free_min_bytes", "gauge", stats.stackHighWaterMark);
+	metric("vebus_heap_free_bytes", "gauge", stats.heapFree);
+	metric("vebus_heap_free_min_bytes", "gauge", stats.heapMinimumFree);
+	metric("vebus_log_drops_total", "counter", stats.logDrops);
+	metric("vebus_requests_dropped_total", "counter", stats.requestsDropped);
+	metric("vebus_requests_shared_total", "counter", stats.requestsShared);
+
+	static const char* stageNames[LatencyStage::SizeOfLatencyStages] = { "queued", "bus_wait", "device", "decode", "dispatch", "callback", "total" };
+	LatencyReport reports[VEBUS_LATENCY_COMMANDS];
+	size_t reportCount = GetLatency(reports, VEBUS_LATENCY_COMMANDS);
+	if (reportCount > 0) append("# TYPE %s %s\n", "vebus_request_latency_us", "summary", 0);
+	for (size_t i = 0; i < reportCount; i++)
+	{
+		for (uint8_t stage = 0; stage < LatencyStage::SizeOfLatencyStages; stage++)
+		{
+			LatencyPercentiles& percentiles = reports[i].stages[stage];
+			const char* quantiles[] = { "0.5", "0.95", "0.99" };
+			uint32_t values[] = { percentiles.p50Us, percentiles.p95Us, percentiles.p99Us };
+			for (uint8_t q = 0; (q < 3) && (length < size); q++)
+			{
+				int written = snprintf(buffer + length, size - length, "vebus_request_latency_us{command=\"0x%02X\",stage=\"%s\",quantile=\"%s\"} %lu\n",
+					reports[i].command, stageNames[stage], quantiles[q], (unsigned long)values[q]);
+				if (written > 0) length += written;
+			}
+			if (length >= size) continue;
+			int written = snprintf(buffer + length, size - length, "vebus_request_latency_us_sum{command=\"0x%02X\",stage=\"%s\"} %llu\n",
+				reports[i].command, stageNames[stage], (unsigned long long)percentiles.sumUs);
+			if (written > 0) length += written;
+			if (length >= size) continue;
+			written = snprintf(buffer + length, size - length, "vebus_request_latency_us_count{command=\"0x%02X\",stage=\"%s\"} %lu\n",
+				reports[i].command, stageNames[stage], (unsigned long)percentiles.count);
+			if (written > 0) length += written;
+		}
+	}
+	return length;
+}
+
+bool VEBus::SetLatencyTracing(bool enabled)
+{
+	LatencyTrace* latency = nullptr;
+	if (enabled)
+	{
+		if (_latency != nullptr) return true;
+		latency = (LatencyTrace*)VEBusContainer::CapsAllocate(sizeof(LatencyTrace) * VEBUS_LATENCY_COMMANDS, VEBUS_COLD_CAPS);
+		if (latency == nullptr) return false;
+		for (uint8_t i = 0; i < VEBUS_LATENCY_COMMANDS; i++) new (&latency[i]) LatencyTrace();
+	}
+
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	LatencyTrace* previous = _latency;
+	_latency = latency;
+	_latencyCommands = 0;
+	_latencyEnabled = enabled;
+	xSemaphoreGive(_semaphoreStatus);
+	if (previous != nullptr) heap_caps_free(previous);
+	return true;
+}
+
+size_t VEBus::GetLatency(LatencyReport* reports, size_t size)
+{
+	size_t count = 0;
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	for (uint8_t i = 0; (_latency != nullptr) && (i < _latencyCommands) && (count < size); i++)
+	{
+		LatencyReport& report = reports[count++];
+		report.command = _latency[i].command;
+		for (uint8_t stage = 0; stage < LatencyStage::SizeOfLatencyStages; stage++)
+		{
+			VEBusHistogram& histogram = _latency[i].stages[stage];
+			report.stages[stage].count = histogram.Count();
+			report.stages[stage].p50Us = histogram.Percentile(50);
+			report.stages[stage].p95Us = histogram.Percentile(95);
+			report.stages[stage].p99Us = histogram.Percentile(99);
+			report.stages[stage].maxUs = histogram.Max();
+			report.stages[stage].sumUs = histogram.Sum();
+		}
+	}
+	xSemaphoreGive(_semaphoreStatus);
+	return count;
+}
+
+void VEBus::ResetLatency()
+{
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	for (uint8_t i = 0; (_latency != nullptr) && (i < VEBUS_LATENCY_COMMANDS); i++)
+	{
+		for (auto& histogram : _latency[i].stages) histogram.Reset();
+	}
+	_latencyCommands = 0;
+	xSemaphoreGive(_semaphoreStatus);
+}
+
+void VEBus::SetWriteCache(bool enabled)
+{
+	_writeCacheEnabled = enabled;
+}
+
+void VEBus::SetWriteRateLimit(uint32_t ramIntervalMs, uint32_t eepromIntervalMs)
+{
+	_ramWriteIntervalMs = ramIntervalMs;
+	_eepromWriteIntervalMs = eepromIntervalMs;
+}
+
+void VEBus::ClearWriteCache()
+{
+	xSemaphoreTake(_semaphoreCache, portMAX_DELAY);
+	for (auto& entry : _ramVarCache) entry = CacheEntry();
+	for (auto& entry : _settingCache) entry = CacheEntry();
+	xSemaphoreGive(_semaphoreCache);
+}
+
+bool VEBus::IsSupported(RamVariables variable, bool info)
+{
+	return !isUnsupported(info ? WinmonCommand::GetRAMVarInfo : WinmonCommand::ReadRAMVar, variable);
+}
+
+bool VEBus::IsSupported(Settings setting, bool info)
+{
+	return !isUnsupported(info ? WinmonCommand::GetSettingInfo : WinmonCommand::ReadSetting, setting);
+}
+
+void VEBus::ClearUnsupported()
+{
+	for (auto& kind : _unsupported)
+	{
+		for (auto& bits : kind) bits = 0;
+	}
 }
 
 char rxbuf[256];
 
 uint8_t VEBus::WriteViaID(RamVariables variable, int16_t rawValue, bool eeprom)
 {
-	Data data;
-	if (!getNextFreeId_1(data.id)) return 0;
-	data.responseExpected = true;
-	data.command = WinmonCommand::WriteRAMVar;
-	data.address = variable;
-	data.expectedResponseCode = 0x87;
-	StorageType storageType = (eeprom == false) ? StorageType::NoEeprom : StorageType::Eeprom;
-	prepareCommandWriteViaID(data.requestData, data.id, data.command, variable, rawValue, storageType);
-	addOrUpdateFifo(data);
-	return data.id;
+	return writeViaID(variable, (uint16_t)rawValue, eeprom).id;
 }
 
 uint8_t VEBus::WriteViaID(RamVariables variable, uint16_t rawValue, bool eeprom)
 {
-	Data data;
-	if (!getNextFreeId_1(data.id)) return 0;
-	data.responseExpected = true;
-	data.command = WinmonCommand::WriteRAMVar;
-	data.address = variable;
-	data.expectedResponseCode = 0x87;
-	StorageType storageType = (eeprom == false) ? StorageType::NoEeprom : StorageType::Eeprom;
-	prepareCommandWriteViaID(data.requestData, data.id, data.command, variable, rawValue, storageType);
-	addOrUpdateFifo(data);
-	return data.id;
+	return writeViaID(variable, rawValue, eeprom).id;
 }
 
 VEBus::RequestResult VEBus::WriteViaID(RamVariables variable, float value, bool eeprom)
 {
 	if (!_ramVarInfoList[variable].available) return {0 , RequestError::ConvertError };
 
-	uint16_t UnsignedRawValue;
-	int16_t signedRawValue;
-	uint8_t id;
-
 	if (_ramVarInfoList[variable].Scale < 0)
 	{
-		signedRawValue = convertRamVarToRawValueSigned(variable, value);
-		id = WriteViaID(variable, signedRawValue, eeprom);
-	}
-	else
-	{
-		UnsignedRawValue = convertRamVarToRawValue(variable, value);
-		id = WriteViaID(variable, UnsignedRawValue, eeprom);
+		int16_t signedRawValue = convertRamVarToRawValueSigned(variable, value);
+		return writeViaID(variable, (uint16_t)signedRawValue, eeprom);
 	}
 
-	if (id == 0) return { 0, RequestError::FifoFull };
-	return { id , RequestError::Success };
+	uint16_t UnsignedRawValue = convertRamVarToRawValue(variable, value);
+	return writeViaID(variable, UnsignedRawValue, eeprom);
 }
 
 uint8_t VEBus::WriteViaID(Settings setting, int16_t rawValue, bool eeprom)
 {
+	return writeViaID(setting, (uint16_t)rawValue, eeprom).id;
+}
+
+uint8_t VEBus::WriteViaID(Settings setting, uint16_t rawValue, bool eeprom)
+{
+	return writeViaID(setting, rawValue, eeprom).id;
+}
+
+VEBus::RequestResult VEBus::WriteViaID(Settings setting, float value, bool eeprom)
+{
+	uint16_t rawValue = convertSettingToRawValue(setting, value);
+	if (_settingInfoList[setting].Maximum < rawValue) return {0, RequestError::OutsideUpperRange};
+	if (_settingInfoList[setting].Minimum > rawValue) return {0, RequestError::OutsideLowerRange};
+	return writeViaID(setting, rawValue, eeprom);
+}
+
+VEBus::RequestResult VEBus::writeViaID(RamVariables variable, uint16_t rawValue, bool eeprom)
+{
+	if (isUnsupported(WinmonCommand::WriteRAMVar, variable)) return { 0, RequestError::NotSupported };
 	Data data;
-	if (!getNextFreeId_1(data.id)) return 0;
+	if (!getNextFreeId_1(data.id)) return { 0, RequestError::FifoFull };
 	data.responseExpected = true;
-	data.command = WinmonCommand::WriteSetting;
-	data.address = setting;
-	data.expectedResponseCode = 0x88;
+	data.command = WinmonCommand::WriteRAMVar;
+	data.address = variable;
+	data.expectedResponseCode = 0x87;
 	StorageType storageType = (eeprom == false) ? StorageType::NoEeprom : StorageType::Eeprom;
-	prepareCommandWriteViaID(data.requestData, data.id, data.command, setting, rawValue, storageType);
-	addOrUpdateFifo(data);
-
-	return data.id;
+	prepareCommandWriteViaID(data.requestData, data.id, data.command, variable, rawValue, storageType);
+	RequestError error = addOrUpdateWrite(data, _ramVarCache[variable], rawValue, eeprom);
+	if (error != RequestError::Success) return { 0, error };
+	return { data.id, RequestError::Success };
 }
 
-uint8_t VEBus::WriteViaID(Settings setting, uint16_t rawValue, bool eeprom)
+VEBus::RequestResult VEBus::writeViaID(Settings setting, uint16_t rawValue, bool eeprom)
 {
+	if (isUnsupported(WinmonCommand::WriteSetting, setting)) return { 0, RequestError::NotSupported };
 	Data data;
-	if (!getNextFreeId_1(data.id)) return 0;
+	if (!getNextFreeId_1(data.id)) return { 0, RequestError::FifoFull };
 	data.responseExpected = true;
 	data.command = WinmonCommand::WriteSetting;
 	data.address = setting;
 	data.expectedResponseCode = 0x88;
 	StorageType storageType = (eeprom == false) ? StorageType::NoEeprom : StorageType::Eeprom;
 	prepareCommandWriteViaID(data.requestData, data.id, data.command, setting, rawValue, storageType);
-	addOrUpdateFifo(data);
-	return data.id;
-}
-
-VEBus::RequestResult VEBus::WriteViaID(Settings setting, float value, bool eeprom)
-{
-	uint16_t rawValue = convertSettingToRawValue(setting, value);
-	if (_settingInfoList[setting].Maximum < rawValue) return {0, RequestError::OutsideUpperRange};
-	if (_settingInfoList[setting].Minimum > rawValue) return {0, RequestError::OutsideLowerRange};
-	uint8_t id = WriteViaID(setting, rawValue, eeprom);
-	if(id == 0) return { 0, RequestError::FifoFull };
-	return { id , RequestError::Success };
+	RequestError error = addOrUpdateWrite(data, _settingCache[setting], rawValue, eeprom);
+	if (error != RequestError::Success) return { 0, error };
+	return { data.id, RequestError::Success };
 }
 
 uint8_t VEBus::Write(Settings setting, uint16_t value)
 {
+	if (isUnsupported(WinmonCommand::WriteSetting, setting)) return 0;
 	Data data;
 	if (!getNextFreeId_1(data.id)) return 0;
 	data.responseExpected = false;
+	data.waitForData = true;
 	data.command = WinmonCommand::WriteSetting;
 	data.address = setting;
 	prepareCommandWriteAddress(data.requestData, data.id, data.command, setting);
-	addOrUpdateFifo(data, false);
+	if (!addOrUpdateFifo(data, false)) {
+		releaseId(data.id);
+		return 0;
+	}
 
+	//If this fails, the WriteAddress is revoked
 	data.responseExpected = true;
+	data.waitForData = false;
 	data.command = WinmonCommand::WriteData;
 	data.address = setting;
 	data.expectedResponseCode = 0x88;
 	prepareCommandWriteData(data.requestData, data.id, value);
-	addOrUpdateFifo(data , false);
+	if (!addOrUpdateFifo(data, false)) return 0;
 	return data.id;
 }
 
 uint8_t VEBus::Write(RamVariables variable, uint16_t value)
 {
+	if (isUnsupported(WinmonCommand::WriteRAMVar, variable)) return 0;
 	Data data;
 	if (!getNextFreeId_1(data.id)) return 0;
 	data.responseExpected = false;
+	data.waitForData = true;
 	data.command = WinmonCommand::WriteRAMVar;
 	data.address = variable;
 	prepareCommandWriteAddress(data.requestData, data.id, data.command, variable);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) {
+		releaseId(data.id);
+		return 0;
+	}
 
+	//If this fails, the WriteAddress is revoked
 	data.responseExpected = true;
+	data.waitForData = false;
 	data.command = WinmonCommand::WriteData;
 	data.expectedResponseCode = 0x87;
 	data.address = variable;
 	prepareCommandWriteData(data.requestData, data.id, value);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) return 0;
 	return data.id;
 }
 
 uint8_t VEBus::Read(RamVariables variable)
 {
+	return Read(variable, ResponseHandler());
+}
+
+uint8_t VEBus::Read(RamVariables variable, ResponseHandler handler)
+{
+	if (isUnsupported(WinmonCommand::ReadRAMVar, variable)) return 0;
 	Data data;
 	if (!getNextFreeId_1(data.id)) return 0;
 	data.responseExpected = true;
 	data.command = WinmonCommand::ReadRAMVar;
 	data.address = variable;
 	data.expectedResponseCode = 0x85;
+	_handlers[data.id & 0x7F] = handler;
 	uint8_t address[] = { variable };
 	prepareCommandReadMultiRAMVar(data.requestData, data.id, address, 1);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) return 0;
 	return data.id;
 }
 
+VEBus::RequestResult VEBus::Read(RamVariables variable, uint32_t maxAgeMs, ResponseData& data)
+{
+	if (isUnsupported(WinmonCommand::ReadRAMVar, variable)) return { 0, RequestError::NotSupported };
+	uint16_t rawValue;
+	if (getCachedValue(_ramVarCache[variable], maxAgeMs, rawValue))
+	{
+		data.id = 0;
+		data.command = WinmonCommand::ReadRAMVar;
+		data.address = variable;
+		decodeRamVarValue(variable, rawValue, data);
+		return { 0, RequestError::Cached };
+	}
+
+	uint8_t id = Read(variable);
+	if (id == 0) return { 0, RequestError::FifoFull };
+	return { id, RequestError::Success };
+}
+
 //* variable size up to 6
 uint8_t VEBus::Read(RamVariables* variable, uint8_t size)
 {
 	if (size > 6) return 0;
 	Data data;
 	uint8_t addresses[6]{};
-	for (uint8_t i = 0; i < size; i++) addresses[i] = variable[i];
+	for (uint8_t i = 0; i < size; i++)
+	{
+		if (isUnsupported(WinmonCommand::ReadRAMVar, variable[i])) return 0;
+		addresses[i] = variable[i];
+	}
 
 	if (!getNextFreeId_1(data.id)) return 0;
 
@@ -299,7 +755,7 @@ uint8_t VEBus::Read(RamVariables* variable, uint8_t size)
 	data.address = variable[0]; //TODO
 	data.expectedResponseCode = 0x85;
 	prepareCommandReadMultiRAMVar(data.requestData, data.id, addresses, size);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) return 0;
 	return data.id;
 }
 
@@ -310,32 +766,88 @@ uint8_t VEBus::Read(RamVariables* variable, uint8_t size)
 // 0x91 = Setting not supported(in which case <Value> is not valid).
 uint8_t VEBus::Read(Settings setting)
 {
+	return Read(setting, ResponseHandler());
+}
+
+uint8_t VEBus::Read(Settings setting, ResponseHandler handler)
+{
+	if (isUnsupported(WinmonCommand::ReadSetting, setting)) return 0;
 	Data data;
 	if (!getNextFreeId_1(data.id)) return 0;
 	data.responseExpected = true;
 	data.command = WinmonCommand::ReadSetting;
 	data.address = setting;
 	data.expectedResponseCode = 0x86;
+	_handlers[data.id & 0x7F] = handler;
 	prepareCommandReadSetting(data.requestData, data.id, setting);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) return 0;
 	return data.id;
 }
 
-uint8_t VEBus::ReadInfo(RamVariables variable)
+VEBus::RequestResult VEBus::Read(Settings setting, uint32_t maxAgeMs, ResponseData& data)
 {
-	Data data;
-	if (!getNextFreeId_1(data.id)) return 0;
-	data.responseExpected = true;
-	data.command = WinmonCommand::GetRAMVarInfo;
-	data.address = variable;
+	if (isUnsupported(WinmonCommand::ReadSetting, setting)) return { 0, RequestError::NotSupported };
+	uint16_t rawValue;
+	if (getCachedValue(_settingCache[setting], maxAgeMs, rawValue))
+	{
+		data.id = 0;
+		data.command = WinmonCommand::ReadSetting;
+		data.address = setting;
+		decodeSettingValue(setting, rawValue, data);
+		return { 0, RequestError::Cached };
+	}
+
+	uint8_t id = Read(setting);
+	if (id == 0) return { 0, RequestError::FifoFull };
+	return { id, RequestError::Success };
+}
+
+bool VEBus::SetSnapShot(RamVariables* variables, uint8_t size)
+{
+	if (size == 0 || size > MAX_SNAPSHOT_SIZE) return false;
+	for (uint8_t i = 0; i < size; i++) _snapShotVariables[i] = variables[i];
+	_snapShotSize = size;
+	return true;
+}
+
+uint8_t VEBus::ReadSnapShot()
+{
+	return ReadSnapShot(ResponseHandler());
+}
+
+//handler is called once per snapshot variable
+uint8_t VEBus::ReadSnapShot(ResponseHandler handler)
+{
+	if (_snapShotSize == 0) return 0;
+	Data data;
+	if (!getNextFreeId_1(data.id)) return 0;
+	data.responseExpected = true;
+	data.command = WinmonCommand::ReadSnapShot;
+	data.address = 0;
+	data.expectedResponseCode = 0x99;
+	_handlers[data.id & 0x7F] = handler;
+	prepareCommandReadSnapShot(data.requestData, data.id, _snapShotVariables, _snapShotSize);
+	if (!addOrUpdateFifo(data)) return 0;
+	return data.id;
+}
+
+uint8_t VEBus::ReadInfo(RamVariables variable)
+{
+	if (isUnsupported(WinmonCommand::GetRAMVarInfo, variable)) return 0;
+	Data data;
+	if (!getNextFreeId_1(data.id)) return 0;
+	data.responseExpected = true;
+	data.command = WinmonCommand::GetRAMVarInfo;
+	data.address = variable;
 	data.expectedResponseCode = 0x8E;
 	prepareCommandReadInfo(data.requestData, data.id, data.command, variable);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) return 0;
 	return data.id;
 }
 
 uint8_t VEBus::ReadInfo(Settings setting)
 {
+	if (isUnsupported(WinmonCommand::GetSettingInfo, setting)) return 0;
 	Data data;
 	if (!getNextFreeId_1(data.id)) return 0;
 	data.responseExpected = true;
@@ -343,7 +855,7 @@ uint8_t VEBus::ReadInfo(Settings setting)
 	data.address = setting;
 	data.expectedResponseCode = 0x89;
 	prepareCommandReadInfo(data.requestData, data.id, data.command, setting);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) return 0;
 	return data.id;
 }
 
@@ -366,6 +878,20 @@ SettingInfo VEBus::GetSettingInfo(Settings setting)
 	return _settingInfoList[setting];
 }
 
+void VEBus::SetDeadband(NotifyField field, float absolute, float relative)
+{
+	if (field >= NotifyField::SizeOfNotifyFields) return;
+	_deadbands[field].absolute = absolute;
+	_deadbands[field].relative = relative;
+}
+
+void VEBus::SetPublishInterval(NotifyGroup group, uint32_t minIntervalMs, uint32_t maxIntervalMs)
+{
+	if (group >= NotifyGroup::SizeOfNotifyGroups) return;
+	_publishIntervals[group].minMs = minIntervalMs;
+	_publishIntervals[group].maxMs = maxIntervalMs;
+}
+
 bool VEBus::NewMasterMultiLedAvailable()
 {
 	return _masterMultiLedNewData;
@@ -427,6 +953,94 @@ AcInfo VEBus::GetAcInfo(uint8_t type)
 	return info;
 }
 
+bool VEBus::SetAggregationWindows(uint32_t* windowsMs, uint8_t size)
+{
+	if (size > MAX_AGGREGATE_WINDOWS) return false;
+	for (uint8_t i = 0; i < size; i++) if (windowsMs[i] == 0) return false;
+
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	for (uint8_t i = 0; i < size; i++) _aggregateWindowsMs[i] = windowsMs[i];
+	_aggregateWindowSize = size;
+	for (auto& window : _dcWindows) window = DcWindow();
+	for (auto& phase : _acWindows) for (auto& window : phase) window = AcWindow();
+	xSemaphoreGive(_semaphoreStatus);
+	return true;
+}
+
+DcAggregate VEBus::GetDcAggregate(uint8_t window)
+{
+	DcAggregate aggregate{};
+	if (window >= MAX_AGGREGATE_WINDOWS) return aggregate;
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	aggregate = _dcWindows[window].completed;
+	xSemaphoreGive(_semaphoreStatus);
+	return aggregate;
+}
+
+AcAggregate VEBus::GetAcAggregate(uint8_t type, uint8_t window)
+{
+	AcAggregate aggregate{};
+	if (window >= MAX_AGGREGATE_WINDOWS) return aggregate;
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	for (uint8_t i = 0; (i < _acInfo.size()) && (i < VEBUS_PHASE_COUNT); i++) {
+		if (_acInfo[i].Phase != type) continue;
+		aggregate = _acWindows[i][window].completed;
+		break;
+	}
+	xSemaphoreGive(_semaphoreStatus);
+	return aggregate;
+}
+
+bool VEBus::SetHistory(size_t dcBytes, size_t acBytes, uint8_t phases)
+{
+	if (phases > VEBUS_PHASE_COUNT) phases = VEBUS_PHASE_COUNT;
+	bool result = true;
+	_dcHistory.Free();
+	for (auto& history : _acHistory) history.Free();
+
+	if (dcBytes > 0) result &= _dcHistory.Allocate(dcBytes, 3);
+	if (acBytes == 0) return result;
+	for (uint8_t i = 0; i < phases; i++) result &= _acHistory[i].Allocate(acBytes, 6);
+	return result;
+}
+
+size_t VEBus::GetDcHistory(uint32_t fromMs, uint32_t toMs, uint32_t resolutionMs, DcSample* samples, size_t size)
+{
+	struct Context { VEBus* bus; DcSample* samples; } context = { this, samples };
+	return _dcHistory.Query(fromMs, toMs, resolutionMs, size, [](const VEBusHistory::Sample& sample, size_t index, void* context) {
+		Context* c = (Context*)context;
+		DcSample& dcSample = c->samples[index];
+		dcSample.TimeMs = sample.timeMs;
+		dcSample.Voltage = c->bus->convertRamVarToValueSigned(RamVariables::UBat, sample.values[0]);
+		dcSample.CurrentInverting = c->bus->convertRamVarToValueSigned(RamVariables::IBat, sample.values[1]);
+		dcSample.CurrentCharging = c->bus->convertRamVarToValueSigned(RamVariables::IBat, sample.values[2]);
+	}, &context);
+}
+
+size_t VEBus::GetAcHistory(uint8_t type, uint32_t fromMs, uint32_t toMs, uint32_t resolutionMs, AcSample* samples, size_t size)
+{
+	uint8_t index = VEBUS_PHASE_COUNT;
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	for (uint8_t i = 0; (i < _acInfo.size()) && (i < VEBUS_PHASE_COUNT); i++) {
+		if (_acInfo[i].Phase != type) continue;
+		index = i;
+		break;
+	}
+	xSemaphoreGive(_semaphoreStatus);
+	if (index >= VEBUS_PHASE_COUNT) return 0;
+
+	struct Context { VEBus* bus; AcSample* samples; } context = { this, samples };
+	return _acHistory[index].Query(fromMs, toMs, resolutionMs, size, [](const VEBusHistory::Sample& sample, size_t index, void* context) {
+		Context* c = (Context*)context;
+		AcSample& acSample = c->samples[index];
+		acSample.TimeMs = sample.timeMs;
+		acSample.MainVoltage = c->bus->convertRamVarToValueSigned(RamVariables::UBat, sample.values[0]);
+		acSample.MainCurrent = c->bus->convertRamVarToValueSigned(RamVariables::IInverterRMS, sample.values[1]) * sample.values[4];
+		acSample.InverterVoltage = c->bus->convertRamVarToValueSigned(RamVariables::UBat, sample.values[2]);
+		acSample.InverterCurrent = c->bus->convertRamVarToValueSigned(RamVariables::IInverterRMS, sample.values[3]) * sample.values[5];
+	}, &context);
+}
+
 uint8_t VEBus::NewAcInfoAvailable()
 {
 	uint8_t phaseId = 0;
@@ -448,7 +1062,7 @@ uint8_t VEBus::ReadSoftwareVersion()
 	data.address = 0;
 	data.expectedResponseCode = 0x82;
 	prepareCommandReadSoftwareVersion(data.requestData, data.id, data.command);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) return 0;
 	return data.id;
 }
 
@@ -461,267 +1075,801 @@ uint8_t VEBus::CommandReadDeviceState()
 	data.address = 0;
 	data.expectedResponseCode = 0x94;
 	prepareCommandSetGetDeviceState(data.requestData, data.id, CommandDeviceState::Inquire);
-	addOrUpdateFifo(data);
+	if (!addOrUpdateFifo(data)) return 0;
 	return data.id;
 }
 
-void VEBus::addOrUpdateFifo(Data data, bool updateIfExist)
+//* return false if the fifo is full
+//Lock-free, can be called from any task. The decode task takes the request over at the next pass (drainSubmissions)
+//Releases the ID if there is no space within the submit timeout
+//The request is copied once, into the submit queue, the submission fields are set on that copy
+bool VEBus::addOrUpdateFifo(const Data& data, bool updateIfExist, bool wait)
+{
+	RequestPriority priority = requestPriority(data.command);
+	uint32_t hash = isShareable(data.command) ? requestHash(data) : 0;
+	uint32_t now = millis();
+	uint32_t nowUs = micros();
+
+	if ((!wait || waitForSpace(priority)) && _submitQueue.push(data, [&](Data& submitted) {
+		submitted.responseData.clear();
+		submitted.sentTimeMs = now;
+		submitted.trace = RequestTrace();
+		submitted.trace.enqueuedUs = nowUs;
+		submitted.updateIfExist = updateIfExist;
+		submitted.priority = priority;
+		submitted.waiterCount = 0;
+		submitted.firstWaiter = 0;
+		submitted.indexed = false;
+		submitted.hash = hash;
+	}))
+	{
+		TaskHandle_t task = _decodeTask;
+		if (task != NULL) xTaskNotifyGive(task);
+		return true;
+	}
+	if (data.command == WinmonCommand::WriteData) revokeWriteAddress(data.id);
+	else if (data.responseExpected) releaseId(data.id);
+	return false;
+}
+
+//Skips writes the device already confirmed and holds writes back until the rate limit
+//of the item expires. A held write stays unsent in the fifo and is overwritten by newer
+//values, so only the latest value goes out. A write that is already sent or staged is not
+//overwritten, the new one waits for the next interval (takeSubmission, scheduleWrite).
+VEBus::RequestError VEBus::addOrUpdateWrite(Data& data, CacheEntry& cache, uint16_t rawValue, bool eeprom)
 {
-	data.responseData.clear();
-	data.sentTimeMs = millis();
+	if (!_writeCacheEnabled)
+	{
+		if (!addOrUpdateFifo(data)) return RequestError::FifoFull;
+		return RequestError::Success;
+	}
 
-	xSemaphoreTake(_semaphoreDataFifo, portMAX_DELAY);
-	if (updateIfExist)
+	xSemaphoreTake(_semaphoreCache, portMAX_DELAY);
+	if ((cache.pendingWrites == 0) && cache.valid && (cache.rawValue == rawValue) && (cache.eeprom || !eeprom))
 	{
-		for (auto& element : _dataFifo) {
+		xSemaphoreGive(_semaphoreCache);
+		releaseId(data.id);
+		return RequestError::Unchanged;
+	}
 
-			if (element.address == data.address && element.command == data.command)
-			{
-				element = data;
-				xSemaphoreGive(_semaphoreDataFifo);
-				return;
-			}
+	//The decode task decides if the write is merged, wait for space without holding the cache
+	RequestPriority priority = requestPriority(data.command);
+	if (!hasSpace(priority))
+	{
+		xSemaphoreGive(_semaphoreCache);
+		if (!waitForSpace(priority))
+		{
+			releaseId(data.id);
+			return RequestError::FifoFull;
 		}
+		xSemaphoreTake(_semaphoreCache, portMAX_DELAY);
 	}
-	
-	_dataFifo.push_back(data);
-	xSemaphoreGive(_semaphoreDataFifo);
+	uint32_t now = millis();
+
+	//Merged into an unsent write it keeps the send time of that write
+	data.sendAfterMs = ((int32_t)(now - cache.nextWriteMs) < 0) ? cache.nextWriteMs : now;
+	data.mergeWrite = true;
+
+	if (!addOrUpdateFifo(data, true, false))
+	{
+		xSemaphoreGive(_semaphoreCache);
+		return RequestError::FifoFull;
+	}
+
+	cache.pendingWrites++;
+	xSemaphoreGive(_semaphoreCache);
+	return RequestError::Success;
 }
 
-//possible ID_1 between 0x80 and 0xFF (0xE4-0xE7 used from Venus OS)
-//* return false if no ID free
-bool VEBus::getNextFreeId_1(uint8_t& id)
+//Decode task, a write got its own fifo entry. The next write of the item waits one interval after it
+void VEBus::scheduleWrite(Data& data)
 {
-	bool idUsed = false;
-	for (uint8_t i = 0; i < 127; i++)
+	xSemaphoreTake(_semaphoreCache, portMAX_DELAY);
+	CacheEntry* cache = writeCacheEntry(data);
+	if (cache != nullptr)
 	{
-		++_id;
-		if (_id < 0x80) _id = 0x80;
+		bool eeprom = (data.requestData[3] & StorageType::NoEeprom) == 0;
+		cache->nextWriteMs = data.sendAfterMs + (eeprom ? _eepromWriteIntervalMs : _ramWriteIntervalMs);
+	}
+	xSemaphoreGive(_semaphoreCache);
+}
 
-		for (auto& element : _dataFifo) {
+//Cache entry of a write via ID, nullptr for other requests
+VEBus::CacheEntry* VEBus::writeCacheEntry(const Data& data)
+{
+	if (data.requestData.size() < 7 || data.requestData[2] != WinmonCommand::WriteViaID) return nullptr;
+	if (data.command == WinmonCommand::WriteRAMVar && data.address < RamVariables::SizeOfRamVarStruct) return &_ramVarCache[data.address];
+	if (data.command == WinmonCommand::WriteSetting && data.address < Settings::SizeOfSettingsStruct) return &_settingCache[data.address];
+	return nullptr;
+}
 
-			if (element.id == _id)
-			{
-				idUsed = true;
-				break;
-			}
-		}
+//Runs with _semaphoreCache taken
+void VEBus::updateWriteCache(const Data& data)
+{
+	CacheEntry* cache = writeCacheEntry(data);
+	if (cache == nullptr) return;
 
-		if (!idUsed)
-		{
-			id = _id;
-			return true;
-		}
-	}
+	cache->valid = true;
+	if (data.mergeWrite && (cache->pendingWrites > 0)) cache->pendingWrites--;
+	cache->eeprom = (data.requestData[3] & StorageType::NoEeprom) == 0;
+	cache->rawValue = ((uint16_t)data.requestData[6] << 8) | data.requestData[5];
+	cache->updatedMs = millis();
+}
 
-	return false;
+//Decode task, a write leaves the fifo without an ack (merged, dropped, timed out, not supported)
+void VEBus::abandonWrite(Data& data)
+{
+	if (!data.mergeWrite) return;
+	xSemaphoreTake(_semaphoreCache, portMAX_DELAY);
+	CacheEntry* cache = writeCacheEntry(data);
+	if ((cache != nullptr) && (cache->pendingWrites > 0)) cache->pendingWrites--;
+	xSemaphoreGive(_semaphoreCache);
 }
 
-void VEBus::prepareCommand(std::vector<uint8_t>& buffer, uint8_t frameNr)
+//A read value is only known to be in RAM, a later EEPROM write of the same value is still sent
+void VEBus::updateValueCache(CacheEntry& cache, uint16_t rawValue)
 {
-	buffer.insert(buffer.begin(), NEXT_FRAME_NR(frameNr));
-	buffer.insert(buffer.begin(), DATA_FRAME);
-	buffer.insert(buffer.begin(), MK3_ID_1);
-	buffer.insert(buffer.begin(), MK3_ID_0);
+	xSemaphoreTake(_semaphoreCache, portMAX_DELAY);
+	setValueCache(cache, rawValue);
+	xSemaphoreGive(_semaphoreCache);
 }
 
-void VEBus::prepareCommandWriteViaID(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand, uint8_t address, int16_t value, StorageType storageType)
+//Runs with _semaphoreCache taken
+void VEBus::setValueCache(CacheEntry& cache, uint16_t rawValue)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(WinmonCommand::WriteViaID);
-	buffer.push_back(((winmonCommand == WinmonCommand::WriteRAMVar) ? VariableType::RamVar : VariableType::Setting) | storageType); // 0x02 -> no eeprom write
-	buffer.push_back(address);
-	buffer.push_back(value & 0xFF);
-	buffer.push_back(value >> 8);
+	if (!cache.valid || cache.rawValue != rawValue) cache.eeprom = false;
+	cache.valid = true;
+	cache.rawValue = rawValue;
+	cache.updatedMs = millis();
 }
 
-void VEBus::prepareCommandWriteViaID(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand, uint8_t address, uint16_t value, StorageType storageType)
+bool VEBus::getCachedValue(CacheEntry& cache, uint32_t maxAgeMs, uint16_t& rawValue)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(WinmonCommand::WriteViaID);
-	buffer.push_back(((winmonCommand == WinmonCommand::WriteRAMVar) ? VariableType::RamVar : VariableType::Setting) | storageType); // 0x02 -> no eeprom write
-	buffer.push_back(address);
-	buffer.push_back(value & 0xFF);
-	buffer.push_back(value >> 8);
+	bool fresh;
+	xSemaphoreTake(_semaphoreCache, portMAX_DELAY);
+	fresh = cache.valid && (millis() - cache.updatedMs <= maxAgeMs);
+	rawValue = cache.rawValue;
+	xSemaphoreGive(_semaphoreCache);
+	return fresh;
 }
 
-// * address size up to 6
-// Response: 0x85 / 0x90 < Lo(Value) > < Hi(Value)>  
-// 0x85 = RamReadOK. 
-// 0x90 = Variable not supported(in which case <Value> is not valid).
-uint8_t VEBus::prepareCommandReadMultiRAMVar(std::vector<uint8_t>& buffer, uint8_t id, uint8_t* addresses, uint8_t addressSize)
+//A value that cannot be read cannot be written either, info requests are cached on their own
+int8_t VEBus::unsupportedKind(uint8_t command)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(WinmonCommand::ReadRAMVar);
-	for (uint8_t i = 0; i < addressSize; i++)
+	switch (command)
 	{
-		buffer.push_back(addresses[i]);
+	case WinmonCommand::ReadRAMVar:
+	case WinmonCommand::WriteRAMVar:
+		return UnsupportedKind::UnsupportedRamVar;
+	case WinmonCommand::GetRAMVarInfo:
+		return UnsupportedKind::UnsupportedRamVarInfo;
+	case WinmonCommand::ReadSetting:
+	case WinmonCommand::WriteSetting:
+		return UnsupportedKind::UnsupportedSetting;
+	case WinmonCommand::GetSettingInfo:
+		return UnsupportedKind::UnsupportedSettingInfo;
+	default:
+		return -1;
 	}
+}
 
-	return addressSize;
+//0x90 = variable not supported, 0x91 = setting not supported
+uint8_t VEBus::unsupportedResponseCode(uint8_t command)
+{
+	switch (unsupportedKind(command))
+	{
+	case UnsupportedKind::UnsupportedRamVar:
+	case UnsupportedKind::UnsupportedRamVarInfo:
+		return 0x90;
+	case UnsupportedKind::UnsupportedSetting:
+	case UnsupportedKind::UnsupportedSettingInfo:
+		return 0x91;
+	default:
+		return 0;
+	}
 }
 
-void VEBus::prepareCommandReadSetting(std::vector<uint8_t>& buffer, uint8_t id, uint16_t address)
+bool VEBus::isUnsupported(uint8_t command, uint8_t address)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(WinmonCommand::ReadSetting);
-	buffer.push_back(address & 0xFF);
-	buffer.push_back(address >> 8);
+	int8_t kind = unsupportedKind(command);
+	if (kind < 0) return false;
+	return (_unsupported[kind][address >> 5] & (1UL << (address & 0x1F))) != 0;
 }
 
-// This command must be followed by writeData (CommandWriteData). 
-// Response: None
-void VEBus::prepareCommandWriteAddress(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand, uint16_t address)
+//Decode task. A read of several RAM variables does not tell which one is not supported
+void VEBus::setUnsupported(Data& data)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(winmonCommand);
-	buffer.push_back(address & 0xFF);
-	buffer.push_back(address >> 8);
+	int8_t kind = unsupportedKind(data.command);
+	if (kind < 0) return;
+	if ((data.command == WinmonCommand::ReadRAMVar) && (data.requestData.size() != 4)) return;
+	_unsupported[kind][data.address >> 5].fetch_or(1UL << (data.address & 0x1F));
 }
 
-// This command must be after writeAddress (CommandWriteSetting or CommandWriteRAMVar).
-// Response:  0x87 / 0x88 XX XX  
-// 0x87 = successful RAM write. 
-// 0x88 = successful setting write.
-void VEBus::prepareCommandWriteData(std::vector<uint8_t>& buffer, uint8_t id, uint16_t value)
+//Decode task
+bool VEBus::readyToSend(Data& data)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(WinmonCommand::WriteData);
-	buffer.push_back(value & 0xFF);
-	buffer.push_back(value >> 8);
+	if (data.IsSent || data.staged || data.waitForData) return false;
+	return (int32_t)(millis() - data.sendAfterMs) >= 0;
 }
 
-void VEBus::prepareCommandReadInfo(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand, uint16_t setting)
+//possible ID_1 between 0x80 and 0xFF (0xE4-0xE7 used from Venus OS)
+//* return false if no ID free
+//Lock-free, the ID is reserved until releaseId()
+bool VEBus::getNextFreeId_1(uint8_t& id)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(winmonCommand);
-	buffer.push_back(setting & 0xFF);
-	buffer.push_back(setting >> 8);
+	for (uint8_t i = 0; i < 128; i++)
+	{
+		uint8_t candidate = 0x80 | (_idCursor++ & 0x7F);
+		if (candidate >= 0xE4 && candidate <= 0xE7) continue;
+
+		uint32_t mask = 1UL << (candidate & 0x1F);
+		if (_idsInUse[(candidate & 0x7F) >> 5].fetch_or(mask) & mask) continue;
+		id = candidate;
+		return true;
+	}
+
+	return false;
 }
 
-//long Winmon frames
-void VEBus::prepareCommandReadSoftwareVersion(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand)
+void VEBus::releaseId(uint8_t id)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(winmonCommand);
+	if (id < 0x80) return;
+	_handlers[id & 0x7F].reset();
+	_idsInUse[(id & 0x7F) >> 5].fetch_and(~(1UL << (id & 0x1F)));
 }
 
-void VEBus::prepareCommandSetGetDeviceState(std::vector<uint8_t>& buffer, uint8_t id, CommandDeviceState command, uint8_t state)
+//Lock-free, the ID stays reserved until the decode task removed the WriteAddress (takeRevoked)
+void VEBus::revokeWriteAddress(uint8_t id)
 {
-	buffer.clear();
-	buffer.push_back(0x00);
-	buffer.push_back(id);
-	buffer.push_back(WinmonCommand::GetSetDeviceState);
-	buffer.push_back(command);
-	buffer.push_back(state);
+	if (id < 0x80) return;
+	_idsRevoked[(id & 0x7F) >> 5].fetch_or(1UL << (id & 0x1F));
 }
 
-//prepareCommand without ID
-void VEBus::prepareCommandSetSwitchState(std::vector<uint8_t>& buffer, SwitchState switchState)
+//Decode task
+//* return true if the WriteAddress with this ID was revoked, the ID is released
+bool VEBus::takeRevoked(uint8_t id)
 {
-	buffer.clear();
-	buffer.push_back(0x3F);
-	buffer.push_back(switchState);
-	buffer.push_back(0x00);
-	buffer.push_back(0x00);
-	buffer.push_back(0x00);
+	if (id < 0x80) return false;
+	uint32_t mask = 1UL << (id & 0x1F);
+	if ((_idsRevoked[(id & 0x7F) >> 5].fetch_and(~mask) & mask) == 0) return false;
+	releaseId(id);
+	return true;
+}
+
+//Decode task, the request leaves the fifo without a response
+void VEBus::releaseIds(Data& data)
+{
+	unindexRequest(data);
+	abandonWrite(data);
+	if (!data.responseExpected) return;
+	releaseId(data.id);
+	for (uint8_t id = data.firstWaiter; id != 0; id = _nextWaiter[id & 0x7F]) releaseId(id);
 }
 
-void VEBus::stuffingFAtoFF(std::vector<uint8_t>& buffer)
+//Reads without side effects, one response answers every caller
+bool VEBus::isShareable(uint8_t command)
 {
-	for (uint8_t i = 4; i < buffer.size(); i++)
+	switch (command)
 	{
-		if (buffer[i] >= 0xFA)
-		{
-			buffer[i] = 0x70 | (buffer[i] & 0x0F);
-			buffer.insert(buffer.begin() + i, 0xFA);
-		}
+	case WinmonCommand::ReadRAMVar:
+	case WinmonCommand::ReadSetting:
+	case WinmonCommand::ReadSnapShot:
+	case WinmonCommand::GetSettingInfo:
+	case WinmonCommand::GetRAMVarInfo:
+	case WinmonCommand::SendSoftwareVersionPart0:
+	case WinmonCommand::SendSoftwareVersionPart1:
+		return true;
+	default:
+		return false;
 	}
 }
 
-void VEBus::DestuffingFAtoFF(std::vector<uint8_t>& buffer)
+//FNV-1a over command, address and the request after the ID
+uint32_t VEBus::requestHash(const Data& data)
+{
+	uint32_t hash = 2166136261UL;
+	hash = (hash ^ data.command) * 16777619UL;
+	hash = (hash ^ data.address) * 16777619UL;
+	for (size_t i = 2; i < data.requestData.size(); i++) hash = (hash ^ data.requestData[i]) * 16777619UL;
+	return hash;
+}
+
+bool VEBus::sameRequest(Data& a, Data& b)
 {
-	for (uint8_t i = 4; i < buffer.size(); i++)
+	if ((a.command != b.command) || (a.address != b.address) || (a.requestData.size() != b.requestData.size())) return false;
+	return memcmp(a.requestData.data() + 2, b.requestData.data() + 2, a.requestData.size() - 2) == 0;
+}
+
+//Decode task. Adds the ID of data to an identical request in the fifo, sent or not
+//* return false if there is none or it has no room for another waiter
+bool VEBus::shareRequest(Data& data)
+{
+	const uint32_t mask = VEBUS_INFLIGHT_INDEX_SIZE - 1;
+	for (uint32_t slot = data.hash & mask; _inflightIndex[slot].id != 0; slot = (slot + 1) & mask)
 	{
-		if (buffer[i] == 0xFA && i != buffer.size() - 1)
-		{
-			buffer[i] = buffer[i + 1] + 0x80;
-			buffer.erase(buffer.begin() + i + 1);
+		if (_inflightIndex[slot].hash != data.hash) continue;
+		for (auto& element : _dataFifo) {
+			if ((element.id != _inflightIndex[slot].id) || !element.indexed) continue;
+			if (!sameRequest(element, data) || (element.waiterCount >= VEBUS_SHARED_WAITERS)) break;
+			_nextWaiter[data.id & 0x7F] = element.firstWaiter;
+			element.firstWaiter = data.id;
+			element.waiterCount++;
+			_counters.requestsShared++;
+			return true;
 		}
 	}
+	return false;
 }
 
-void VEBus::appendChecksum(std::vector<uint8_t>& buffer)
+//Decode task. The index has more slots than the fifo entries, a free slot is always found
+void VEBus::indexRequest(Data& data)
 {
-	//calculate checksum without MK3_ID
-	uint8_t cs = 1;
-	if (buffer.size() < 2) return;
+	const uint32_t mask = VEBUS_INFLIGHT_INDEX_SIZE - 1;
+	uint32_t slot = data.hash & mask;
+	while (_inflightIndex[slot].id != 0) slot = (slot + 1) & mask;
+	_inflightIndex[slot].hash = data.hash;
+	_inflightIndex[slot].id = data.id;
+	data.indexed = true;
+}
 
-	for (int i = 2; i < buffer.size(); i++) cs -= buffer[i];
+//Decode task. Moves following entries back into the free slot, no tombstones
+void VEBus::unindexRequest(Data& data)
+{
+	if (!data.indexed) return;
+	data.indexed = false;
 
-	if (cs >= 0xFB)
+	const uint32_t mask = VEBUS_INFLIGHT_INDEX_SIZE - 1;
+	uint32_t hole = data.hash & mask;
+	while ((_inflightIndex[hole].id != data.id) || (_inflightIndex[hole].hash != data.hash))
 	{
-		buffer.push_back(0xFA);
-		buffer.push_back(cs - 0xFA);
+		if (_inflightIndex[hole].id == 0) return;
+		hole = (hole + 1) & mask;
 	}
-	else
+
+	for (uint32_t slot = (hole + 1) & mask; _inflightIndex[slot].id != 0; slot = (slot + 1) & mask)
 	{
-		buffer.push_back(cs);
+		uint32_t home = _inflightIndex[slot].hash & mask;
+		if (((slot - home) & mask) < ((slot - hole) & mask)) continue;
+		_inflightIndex[hole] = _inflightIndex[slot];
+		hole = slot;
 	}
-
-	buffer.push_back(END_OF_FRAME);  //End Of Frame
+	_inflightIndex[hole].id = 0;
 }
 
-uint16_t VEBus::convertRamVarToRawValue(RamVariables variable, float value)
+VEBus::RequestPriority VEBus::requestPriority(uint8_t command)
 {
-	uint16_t rawValue;
-	int16_t scale = abs(_ramVarInfoList[variable].Scale);
-	if (scale >= 0x4000) scale = (0x8000 - scale);
-
-	rawValue = value * (scale + 0.0f);
-	rawValue -= _ramVarInfoList[variable].Offset;
-	return rawValue;
+	switch (command)
+	{
+	case WinmonCommand::ReadRAMVar:
+	case WinmonCommand::ReadSetting:
+	case WinmonCommand::ReadSnapShot:
+		return RequestPriority::PriorityNormal;
+	case WinmonCommand::SendSoftwareVersionPart0:
+	case WinmonCommand::SendSoftwareVersionPart1:
+	case WinmonCommand::GetSettingInfo:
+	case WinmonCommand::GetRAMVarInfo:
+		return RequestPriority::PriorityLow;
+	default:
+		return RequestPriority::PriorityHigh;
+	}
 }
 
-float VEBus::convertRamVarToValue(RamVariables variable, uint16_t rawValue)
+//Approximate, the decode task and other tasks change the fifo at the same time
+bool VEBus::hasSpace(RequestPriority priority)
 {
-	float value;
-	int16_t scale = abs(_ramVarInfoList[variable].Scale);
-	if (scale >= 0x4000) scale = (0x8000 - scale);
-
-	value = rawValue / (scale + 0.0f);
-	value += _ramVarInfoList[variable].Offset;
-	return value;
+	if (_submitQueue.size() >= VEBUS_SUBMIT_DEPTH) return false;
+	if (GetFifoSize() < VEBUS_REQUEST_POOL_SIZE) return true;
+	//The decode task drops a request of lower priority or holds this one until an entry is free
+	return (_overflowPolicy == OverflowPolicy::DropLowestPriority) && (priority > RequestPriority::PriorityLow);
 }
 
-int16_t VEBus::convertRamVarToRawValueSigned(RamVariables variable, float value)
+//Blocks the calling task up to _submitTimeoutMs, woken by the decode task when entries are freed (fifoChanged)
+bool VEBus::waitForSpace(RequestPriority priority)
 {
-	int16_t rawValue;
-	int16_t scale = abs(_ramVarInfoList[variable].Scale);
-	if (scale >= 0x4000) scale = (0x8000 - scale);
+	if (hasSpace(priority)) return true;
+	uint32_t timeoutMs = _submitTimeoutMs;
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	//These tasks empty the fifo, they must not wait for it
+	if ((timeoutMs == 0) || (task == _communicationTask) || (task == _dispatcherTask)) return false;
 
-	rawValue = value * (scale + 0.0f);
-	rawValue -= _ramVarInfoList[variable].Offset;
-	return rawValue;
+	std::atomic<TaskHandle_t>* waiter = nullptr;
+	for (auto& slot : _submitWaiters)
+	{
+		TaskHandle_t expected = NULL;
+		if (!slot.compare_exchange_strong(expected, task)) continue;
+		waiter = &slot;
+		break;
+	}
+	if (waiter == nullptr) return false;
+
+	//Registered before checking again, a notification in between is not lost
+	uint32_t startMs = millis();
+	bool space;
+	while (!(space = hasSpace(priority)))
+	{
+		uint32_t elapsedMs = millis() - startMs;
+		if (elapsedMs >= timeoutMs) break;
+		TickType_t ticks = pdMS_TO_TICKS(timeoutMs - elapsedMs);
+		ulTaskNotifyTake(pdTRUE, (ticks == 0) ? 1 : ticks);
+	}
+	waiter->store(NULL);
+	return space;
 }
 
-float VEBus::convertRamVarToValueSigned(RamVariables variable, int16_t rawValue)
+//Decode task, the only place that adds to _dataFifo
+void VEBus::drainSubmissions()
+{
+	if (!_submissionHeld && _submitQueue.empty()) return;
+
+	if (_submissionHeld)
+	{
+		if (!takeSubmission(_heldSubmission))
+		{
+			fifoChanged(false);
+			return;
+		}
+		_submissionHeld = false;
+	}
+
+	bool freed = false;
+	while (_submitQueue.pop(_heldSubmission))
+	{
+		freed = true;
+		if (takeSubmission(_heldSubmission)) continue;
+		_submissionHeld = true;
+		break;
+	}
+	fifoChanged(freed);
+}
+
+//Decode task. Returns false if the fifo is full and no request can be dropped
+bool VEBus::takeSubmission(Data& data)
+{
+	if (data.waitForData && takeRevoked(data.id))
+	{
+		logEvent(LogLevel::Warning, LogEvent::LogDeleted, data.id, data.command);
+		return true;
+	}
+
+	//The WriteAddress of this WriteData can be sent now
+	if (data.command == WinmonCommand::WriteData)
+	{
+		for (auto& element : _dataFifo) {
+			if (element.waitForData && element.id == data.id) element.waitForData = false;
+		}
+	}
+
+	Data* pending = nullptr;
+	if (data.responseExpected && isShareable(data.command))
+	{
+		if (shareRequest(data)) return true;
+	}
+	else if (data.updateIfExist)
+	{
+		//A sent or staged request waits for its response, it is not overwritten
+		for (auto& element : _dataFifo) {
+			if (element.address != data.address || element.command != data.command) continue;
+			if (element.IsSent || element.staged) continue;
+			pending = &element;
+			break;
+		}
+	}
+
+	if (pending != nullptr)
+	{
+		//Merge into the pending write, it keeps its send time. Keep the EEPROM flag if one of the merged writes requested it.
+		if (data.mergeWrite)
+		{
+			data.requestData[3] &= pending->requestData[3];
+			data.sendAfterMs = pending->sendAfterMs;
+		}
+		if (pending->responseExpected && (pending->id != data.id)) releaseId(pending->id);
+		abandonWrite(*pending);
+		*pending = data;
+		return true;
+	}
+
+	if (_dataFifo.size() >= VEBUS_REQUEST_POOL_SIZE)
+	{
+		if (_overflowPolicy != OverflowPolicy::DropLowestPriority) return false;
+		if (!dropLowerPriority(data.priority)) return false;
+	}
+
+	_dataFifo.push_back(data);
+	if (data.mergeWrite) scheduleWrite(data);
+	if (data.responseExpected && isShareable(data.command)) indexRequest(_dataFifo.back());
+	if (_dataFifo.size() > _counters.requestQueueHighWater) _counters.requestQueueHighWater = _dataFifo.size();
+	return true;
+}
+
+//Decode task. Drops the newest unsent request of the lowest priority below priority
+bool VEBus::dropLowerPriority(RequestPriority priority)
+{
+	int32_t drop = -1;
+	for (uint8_t i = 0; i < _dataFifo.size(); i++)
+	{
+		if (_dataFifo[i].IsSent || _dataFifo[i].staged || (_dataFifo[i].priority >= priority)) continue;
+		if ((drop < 0) || (_dataFifo[i].priority <= _dataFifo[drop].priority)) drop = i;
+	}
+	if (drop < 0) return false;
+
+	Data& data = _dataFifo[drop];
+	logEvent(LogLevel::Warning, LogEvent::LogDropped, data.id, data.command, data.priority);
+	releaseIds(data);
+	_counters.requestsDropped++;
+	_dataFifo.erase(_dataFifo.begin() + drop);
+	return true;
+}
+
+//Decode task after _dataFifo changed. freed: entries were removed, waiting tasks are woken
+void VEBus::fifoChanged(bool freed)
+{
+	_fifoSize = _dataFifo.size() + (_submissionHeld ? 1 : 0);
+	uint32_t size = GetFifoSize();
+
+	if (_highWatermark != 0)
+	{
+		bool above = _aboveHighWatermark;
+		if ((!above && (size >= _highWatermark)) || (above && (size <= _lowWatermark)))
+		{
+			_aboveHighWatermark = !above;
+			_watermarkChanged = true;
+			notifyDispatcher();
+		}
+	}
+
+	if (!freed) return;
+	for (auto& slot : _submitWaiters)
+	{
+		TaskHandle_t task = slot;
+		if (task != NULL) xTaskNotifyGive(task);
+	}
+}
+
+//Decode task. Answered requests are passed to Maintain(), wrong answers are sent again
+void VEBus::completeResponses()
+{
+	bool completed = false;
+	size_t size = _dataFifo.size();
+	for (uint8_t i = 0; i < _dataFifo.size();)
+	{
+		Data& data = _dataFifo[i];
+		if (data.responseData.size() < 7) {
+			i++;
+			continue;
+		}
+
+		bool unsupported = (data.responseData[6] != 0) && (data.responseData[6] == unsupportedResponseCode(data.command));
+		if (unsupported || (data.responseData[6] == data.expectedResponseCode))
+		{
+			//Maintain() is behind, try again at the next pass. Only this task pushes, the free space can only grow
+			if (VEBUS_COMPLETION_DEPTH - _completionQueue.size() < 1u + data.waiterCount) break;
+			unindexRequest(data);
+			revokeStaged(data);
+			if (unsupported) {
+				setUnsupported(data);
+				abandonWrite(data);
+			}
+			data.trace.completedUs = micros();
+			//The IDs stay reserved until Maintain() delivered the response, they select the handler
+			_completionQueue.push(data);
+			//Every caller of a shared request gets the response with its own ID, the latency is recorded once
+			data.trace.waiter = true;
+			for (uint8_t id = data.firstWaiter; id != 0; id = _nextWaiter[id & 0x7F])
+			{
+				data.id = id;
+				_completionQueue.push(data);
+			}
+			completed = true;
+			_dataFifo.erase(_dataFifo.begin() + i);
+			continue;
+		}
+
+		if (data.resendCount >= MAX_RESEND) {
+			releaseIds(data);
+			revokeStaged(data);
+			_dataFifo.erase(_dataFifo.begin() + i);
+			continue;
+		}
+
+		_counters.resends++;
+		data.resendCount++;
+		data.IsSent = false;
+		data.sentTimeMs = millis();
+		data.responseData.clear();
+		i++;
+	}
+	fifoChanged(_dataFifo.size() < size);
+	if (completed) notifyDispatcher();
+}
+
+void VEBus::prepareCommand(Buffer& buffer, uint8_t frameNr)
+{
+	buffer.insert(buffer.begin(), NEXT_FRAME_NR(frameNr));
+	buffer.insert(buffer.begin(), DATA_FRAME);
+	buffer.insert(buffer.begin(), MK3_ID_1);
+	buffer.insert(buffer.begin(), MK3_ID_0);
+}
+
+void VEBus::prepareCommandWriteViaID(Buffer& buffer, uint8_t id, uint8_t winmonCommand, uint8_t address, int16_t value, StorageType storageType)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(WinmonCommand::WriteViaID);
+	buffer.push_back(((winmonCommand == WinmonCommand::WriteRAMVar) ? VariableType::RamVar : VariableType::Setting) | storageType); // 0x02 -> no eeprom write
+	buffer.push_back(address);
+	buffer.push_back(value & 0xFF);
+	buffer.push_back(value >> 8);
+}
+
+void VEBus::prepareCommandWriteViaID(Buffer& buffer, uint8_t id, uint8_t winmonCommand, uint8_t address, uint16_t value, StorageType storageType)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(WinmonCommand::WriteViaID);
+	buffer.push_back(((winmonCommand == WinmonCommand::WriteRAMVar) ? VariableType::RamVar : VariableType::Setting) | storageType); // 0x02 -> no eeprom write
+	buffer.push_back(address);
+	buffer.push_back(value & 0xFF);
+	buffer.push_back(value >> 8);
+}
+
+// * address size up to 6
+// Response: 0x85 / 0x90 < Lo(Value) > < Hi(Value)>  
+// 0x85 = RamReadOK. 
+// 0x90 = Variable not supported(in which case <Value> is not valid).
+uint8_t VEBus::prepareCommandReadMultiRAMVar(Buffer& buffer, uint8_t id, uint8_t* addresses, uint8_t addressSize)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(WinmonCommand::ReadRAMVar);
+	for (uint8_t i = 0; i < addressSize; i++)
+	{
+		buffer.push_back(addresses[i]);
+	}
+
+	return addressSize;
+}
+
+// * address size up to 6
+// The device captures all variables at the same moment.
+// Response: 0x99 < Lo(Value0) > < Hi(Value0)> ... < Lo(ValueN) > < Hi(ValueN)>
+void VEBus::prepareCommandReadSnapShot(Buffer& buffer, uint8_t id, uint8_t* addresses, uint8_t addressSize)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(WinmonCommand::ReadSnapShot);
+	for (uint8_t i = 0; i < addressSize; i++)
+	{
+		buffer.push_back(addresses[i]);
+	}
+}
+
+void VEBus::prepareCommandReadSetting(Buffer& buffer, uint8_t id, uint16_t address)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(WinmonCommand::ReadSetting);
+	buffer.push_back(address & 0xFF);
+	buffer.push_back(address >> 8);
+}
+
+// This command must be followed by writeData (CommandWriteData). 
+// Response: None
+void VEBus::prepareCommandWriteAddress(Buffer& buffer, uint8_t id, uint8_t winmonCommand, uint16_t address)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(winmonCommand);
+	buffer.push_back(address & 0xFF);
+	buffer.push_back(address >> 8);
+}
+
+// This command must be after writeAddress (CommandWriteSetting or CommandWriteRAMVar).
+// Response:  0x87 / 0x88 XX XX  
+// 0x87 = successful RAM write. 
+// 0x88 = successful setting write.
+void VEBus::prepareCommandWriteData(Buffer& buffer, uint8_t id, uint16_t value)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(WinmonCommand::WriteData);
+	buffer.push_back(value & 0xFF);
+	buffer.push_back(value >> 8);
+}
+
+void VEBus::prepareCommandReadInfo(Buffer& buffer, uint8_t id, uint8_t winmonCommand, uint16_t setting)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(winmonCommand);
+	buffer.push_back(setting & 0xFF);
+	buffer.push_back(setting >> 8);
+}
+
+//long Winmon frames
+void VEBus::prepareCommandReadSoftwareVersion(Buffer& buffer, uint8_t id, uint8_t winmonCommand)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(winmonCommand);
+}
+
+void VEBus::prepareCommandSetGetDeviceState(Buffer& buffer, uint8_t id, CommandDeviceState command, uint8_t state)
+{
+	buffer.clear();
+	buffer.push_back(0x00);
+	buffer.push_back(id);
+	buffer.push_back(WinmonCommand::GetSetDeviceState);
+	buffer.push_back(command);
+	buffer.push_back(state);
+}
+
+//prepareCommand without ID
+void VEBus::prepareCommandSetSwitchState(Buffer& buffer, SwitchState switchState)
+{
+	buffer.clear();
+	buffer.push_back(0x3F);
+	buffer.push_back(switchState);
+	buffer.push_back(0x00);
+	buffer.push_back(0x00);
+	buffer.push_back(0x00);
+}
+
+void VEBus::stuffingFAtoFF(Buffer& buffer)
+{
+	size_t length = buffer.size();
+	buffer.resize(VEBusFrameCodec::StuffedLength(buffer.data(), length));
+	buffer.resize(VEBusFrameCodec::Stuff(buffer.data(), length, buffer.data(), buffer.size()));
+}
+
+void VEBus::DestuffingFAtoFF(Buffer& buffer)
+{
+	buffer.resize(VEBusFrameCodec::Destuff(buffer.data(), buffer.size(), buffer.data(), buffer.size()));
+}
+
+uint16_t VEBus::convertRamVarToRawValue(RamVariables variable, float value)
+{
+	uint16_t rawValue;
+	int16_t scale = abs(_ramVarInfoList[variable].Scale);
+	if (scale >= 0x4000) scale = (0x8000 - scale);
+
+	rawValue = value * (scale + 0.0f);
+	rawValue -= _ramVarInfoList[variable].Offset;
+	return rawValue;
+}
+
+float VEBus::convertRamVarToValue(RamVariables variable, uint16_t rawValue)
+{
+	float value;
+	int16_t scale = abs(_ramVarInfoList[variable].Scale);
+	if (scale >= 0x4000) scale = (0x8000 - scale);
+
+	value = rawValue / (scale + 0.0f);
+	value += _ramVarInfoList[variable].Offset;
+	return value;
+}
+
+int16_t VEBus::convertRamVarToRawValueSigned(RamVariables variable, float value)
+{
+	int16_t rawValue;
+	int16_t scale = abs(_ramVarInfoList[variable].Scale);
+	if (scale >= 0x4000) scale = (0x8000 - scale);
+
+	rawValue = value * (scale + 0.0f);
+	rawValue -= _ramVarInfoList[variable].Offset;
+	return rawValue;
+}
+
+float VEBus::convertRamVarToValueSigned(RamVariables variable, int16_t rawValue)
 {
 	float value;
 	int16_t scale = abs(_ramVarInfoList[variable].Scale);
@@ -761,10 +1909,15 @@ float VEBus::convertSettingToValue(Settings setting, uint16_t rawValue)
 
 
 
-//Runs on core 0
-ReceivedMessageType VEBus::decodeVEbusFrame(std::vector<uint8_t>& buffer)
+//Decode task
+ReceivedMessageType VEBus::decodeVEbusFrame(Buffer& buffer)
 {
 	ReceivedMessageType result = ReceivedMessageType::Unknown;
+	if (_harvestingEnabled && (buffer[0] == MK3_ID_0) && (buffer[1] == MK3_ID_1))
+	{
+		observeMasterRequest(buffer);
+		return ReceivedMessageType::Unknown;
+	}
 	if ((buffer[0] != MP_ID_0) || (buffer[1] != MP_ID_1)) return ReceivedMessageType::Unknown;
 	if ((buffer[2] == SYNC_FRAME) && (buffer.size() == 10) && (buffer[4] == SYNC_BYTE)) return ReceivedMessageType::sync;
 	if (buffer[2] != DATA_FRAME) return ReceivedMessageType::Unknown;
@@ -773,14 +1926,18 @@ ReceivedMessageType VEBus::decodeVEbusFrame(std::vector<uint8_t>& buffer)
 	case 0x00:
 	{
 		if (buffer.size() < 6) return ReceivedMessageType::Unknown;
-		xSemaphoreTake(_semaphoreDataFifo, portMAX_DELAY);
+		bool ownResponse = false;
 		for (uint8_t i = 0; i < _dataFifo.size(); i++)
 		{
 			if (_dataFifo[i].id != buffer[5]) continue;
 			_dataFifo[i].responseData = buffer;
+			_dataFifo[i].trace.receivedUs = _decodeTimeUs;
+			_dataFifo[i].trace.received = true;
+			ownResponse = true;
 			break;
 		}
-		xSemaphoreGive(_semaphoreDataFifo);
+		if (!ownResponse && _harvestingEnabled) harvestResponse(buffer);
+		completeResponses();
 		break;
 	}
 	case 0x20: //Info Frame
@@ -823,7 +1980,206 @@ ReceivedMessageType VEBus::decodeVEbusFrame(std::vector<uint8_t>& buffer)
 	return result;
 }
 
-void VEBus::decodeChargerInverterCondition(std::vector<uint8_t>& buffer)
+//Decode task
+//Request of another master: 98 F7 FE <frameNr> 00 <id> <command> <data> <checksum> FF
+void VEBus::observeMasterRequest(Buffer& buffer)
+{
+	if ((buffer.size() < 10) || (buffer[2] != DATA_FRAME) || (buffer[4] != 0x00)) return;
+
+	ObservedRequest request;
+	request.valid = true;
+	request.id = buffer[5];
+	request.command = buffer[6];
+	switch (request.command)
+	{
+	case WinmonCommand::ReadRAMVar:
+		request.addressSize = buffer.size() - 9;
+		if (request.addressSize > 6) return;
+		for (uint8_t i = 0; i < request.addressSize; i++) request.addresses[i] = buffer[7 + i];
+		break;
+	case WinmonCommand::ReadSetting:
+		if (buffer.size() != 11 || buffer[8] != 0) return;
+		request.addressSize = 1;
+		request.addresses[0] = buffer[7];
+		break;
+	default:
+		return;
+	}
+
+	uint8_t slot = _observedRequestIndex;
+	for (uint8_t i = 0; i < sizeof(_observedRequests) / sizeof(_observedRequests[0]); i++) {
+		if (_observedRequests[i].valid && _observedRequests[i].id != request.id) continue;
+		slot = i;
+		break;
+	}
+	if (slot == _observedRequestIndex) _observedRequestIndex = (_observedRequestIndex + 1) % (sizeof(_observedRequests) / sizeof(_observedRequests[0]));
+	_observedRequests[slot] = request;
+}
+
+//Decode task
+void VEBus::harvestResponse(Buffer& buffer)
+{
+	for (auto& request : _observedRequests)
+	{
+		if (!request.valid || request.id != buffer[5]) continue;
+		request.valid = false;
+
+		uint8_t expectedResponseCode = (request.command == WinmonCommand::ReadRAMVar) ? 0x85 : 0x86;
+		if ((buffer.size() != 9 + request.addressSize * 2u) || (buffer[6] != expectedResponseCode)) return;
+
+		for (uint8_t i = 0; i < request.addressSize; i++)
+		{
+			uint16_t rawValue = ((uint16_t)buffer[8 + i * 2] << 8) | buffer[7 + i * 2];
+			harvestValue(request.command, request.addresses[i], rawValue, buffer[3]);
+		}
+		return;
+	}
+}
+
+//Decode task
+//A pending own read of the same value is answered with the harvested value
+bool VEBus::harvestValue(uint8_t command, uint8_t address, uint16_t rawValue, uint8_t frameNr)
+{
+	if ((command == WinmonCommand::ReadRAMVar) && (address >= RamVariables::SizeOfRamVarStruct)) return false;
+	if ((command == WinmonCommand::ReadSetting) && (address >= Settings::SizeOfSettingsStruct)) return false;
+
+	for (auto& element : _dataFifo)
+	{
+		if (element.command != command || element.address != address || !element.responseData.empty()) continue;
+		if (command == WinmonCommand::ReadRAMVar && element.requestData.size() != 4) continue;
+		//Staged or sent requests keep their ID until the own response arrives
+		if (element.staged || element.IsSent) continue;
+
+		uint8_t response[] = { MP_ID_0, MP_ID_1, DATA_FRAME, frameNr, 0x00, element.id, element.expectedResponseCode, (uint8_t)(rawValue & 0xFF), (uint8_t)(rawValue >> 8), 0x00, END_OF_FRAME };
+		element.responseData.clear();
+		for (uint8_t i = 0; i < sizeof(response); i++) element.responseData.push_back(response[i]);
+		element.trace.receivedUs = _decodeTimeUs;
+		element.trace.received = true;
+		return true;
+	}
+
+	HarvestedValue value = { command, address, rawValue };
+	if (!_harvestQueue.push(value)) return false;
+	notifyDispatcher();
+	return true;
+}
+
+void VEBus::callHarvestedValues()
+{
+	HarvestedValue value;
+	while (_harvestQueue.pop(value))
+	{
+		ResponseData responseData;
+		responseData.id = 0;
+		responseData.command = value.command;
+		responseData.address = value.address;
+		if (value.command == WinmonCommand::ReadRAMVar)
+		{
+			updateValueCache(_ramVarCache[value.address], value.rawValue);
+			decodeRamVarValue((RamVariables)value.address, value.rawValue, responseData);
+		}
+		else
+		{
+			updateValueCache(_settingCache[value.address], value.rawValue);
+			decodeSettingValue((Settings)value.address, value.rawValue, responseData);
+		}
+		ResponseHandler handler;
+		deliverResponse(responseData, handler);
+	}
+}
+
+//Decode task
+void VEBus::aggregateDcInfo(DcInfo& info)
+{
+	if (_aggregateWindowSize == 0) return;
+	uint32_t now = millis();
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	for (uint8_t i = 0; i < _aggregateWindowSize; i++)
+	{
+		DcWindow& window = _dcWindows[i];
+		if ((window.voltage.count > 0) && (now - window.startMs >= _aggregateWindowsMs[i]))
+		{
+			window.completed.StartMs = window.startMs;
+			window.completed.WindowMs = _aggregateWindowsMs[i];
+			window.completed.Voltage = completeAccumulator(window.voltage);
+			window.completed.CurrentInverting = completeAccumulator(window.currentInverting);
+			window.completed.CurrentCharging = completeAccumulator(window.currentCharging);
+		}
+		if (window.voltage.count == 0) window.startMs = now;
+		accumulate(window.voltage, info.Voltage);
+		accumulate(window.currentInverting, info.CurrentInverting);
+		accumulate(window.currentCharging, info.CurrentCharging);
+	}
+	xSemaphoreGive(_semaphoreStatus);
+}
+
+//Decode task with _semaphoreStatus taken
+void VEBus::aggregateAcInfo(uint8_t index, AcInfo& info)
+{
+	if (index >= VEBUS_PHASE_COUNT) return;
+	uint32_t now = millis();
+	for (uint8_t i = 0; i < _aggregateWindowSize; i++)
+	{
+		AcWindow& window = _acWindows[index][i];
+		if ((window.mainVoltage.count > 0) && (now - window.startMs >= _aggregateWindowsMs[i]))
+		{
+			window.completed.Phase = info.Phase;
+			window.completed.StartMs = window.startMs;
+			window.completed.WindowMs = _aggregateWindowsMs[i];
+			window.completed.MainVoltage = completeAccumulator(window.mainVoltage);
+			window.completed.MainCurrent = completeAccumulator(window.mainCurrent);
+			window.completed.InverterVoltage = completeAccumulator(window.inverterVoltage);
+			window.completed.InverterCurrent = completeAccumulator(window.inverterCurrent);
+		}
+		if (window.mainVoltage.count == 0) window.startMs = now;
+		accumulate(window.mainVoltage, info.MainVoltage);
+		accumulate(window.mainCurrent, info.MainCurrent);
+		accumulate(window.inverterVoltage, info.InverterVoltage);
+		accumulate(window.inverterCurrent, info.InverterCurrent);
+	}
+}
+
+void VEBus::accumulate(Accumulator& accumulator, float value)
+{
+	if ((accumulator.count == 0) || (value < accumulator.min)) accumulator.min = value;
+	if ((accumulator.count == 0) || (value > accumulator.max)) accumulator.max = value;
+	if (accumulator.count == 0) accumulator.sum = 0;
+	accumulator.sum += value;
+	accumulator.count++;
+}
+
+//Returns the aggregate and starts a new window
+Aggregate VEBus::completeAccumulator(Accumulator& accumulator)
+{
+	Aggregate aggregate;
+	aggregate.Min = accumulator.min;
+	aggregate.Max = accumulator.max;
+	aggregate.Mean = accumulator.sum / accumulator.count;
+	aggregate.Count = accumulator.count;
+	accumulator.count = 0;
+	return aggregate;
+}
+
+bool VEBus::exceedsDeadband(NotifyField field, float value, float publishedValue)
+{
+	float threshold = _deadbands[field].absolute;
+	float relative = _deadbands[field].relative * fabsf(publishedValue);
+	if (relative > threshold) threshold = relative;
+	return fabsf(value - publishedValue) > threshold;
+}
+
+//Returns true and restarts the interval if the group is published now
+bool VEBus::publishDue(NotifyGroup group, bool changed, uint32_t& publishedMs)
+{
+	uint32_t now = millis();
+	PublishInterval& interval = _publishIntervals[group];
+	if (changed && (now - publishedMs < interval.minMs)) return false;
+	if (!changed && ((interval.maxMs == 0) || (now - publishedMs < interval.maxMs))) return false;
+	publishedMs = now;
+	return true;
+}
+
+void VEBus::decodeChargerInverterCondition(Buffer& buffer)
 {
 	if ((buffer.size() == 19) && (buffer[5] == 0x80) && ((buffer[6] & 0xFE) == 0x12) && (buffer[8] == 0x80) && ((buffer[11] & 0x10) == 0x10) && (buffer[12] == 0x00))
 	{
@@ -844,10 +2200,10 @@ void VEBus::decodeChargerInverterCondition(std::vector<uint8_t>& buffer)
 
 		bool newValue = false;
 		newValue |= _multiPlusStatus.DcLevelAllowsInverting != dcLevelAllowsInverting;
-		newValue |= _multiPlusStatus.DcCurrentA != dcCurrentA;
-		if ((buffer[11] & 0xF0) == 0x30) newValue |= _multiPlusStatus.Temp != temp;
+		newValue |= exceedsDeadband(NotifyField::StatusDcCurrent, dcCurrentA, _multiPlusStatus.DcCurrentA);
+		if ((buffer[11] & 0xF0) == 0x30) newValue |= exceedsDeadband(NotifyField::StatusTemp, temp, _multiPlusStatus.Temp);
 
-		if (newValue)
+		if (publishDue(NotifyGroup::NotifyMultiPlusStatus, newValue, _publishedMs[NotifyGroup::NotifyMultiPlusStatus]))
 		{
 			xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
 			_multiPlusStatus.DcLevelAllowsInverting = dcLevelAllowsInverting;
@@ -860,7 +2216,7 @@ void VEBus::decodeChargerInverterCondition(std::vector<uint8_t>& buffer)
 	}
 }
 
-void VEBus::decodeBatteryCondition(std::vector<uint8_t>& buffer)
+void VEBus::decodeBatteryCondition(Buffer& buffer)
 {
 	if ((buffer.size() == 15) && (buffer[5] == 0x81) && (buffer[6] == 0x64) && (buffer[7] == 0x14) && (buffer[8] == 0xBC) && (buffer[9] == 0x02) && (buffer[12] == 0x00))
 	{
@@ -876,7 +2232,7 @@ void VEBus::decodeBatteryCondition(std::vector<uint8_t>& buffer)
 	}
 }
 
-void VEBus::decodeMasterMultiLed(std::vector<uint8_t>& buffer)
+void VEBus::decodeMasterMultiLed(Buffer& buffer)
 {
 	LEDData lEDon{};
 	LEDData lEDblink{};
@@ -895,12 +2251,12 @@ void VEBus::decodeMasterMultiLed(std::vector<uint8_t>& buffer)
 	newValue |= _masterMultiLed.LEDblink.value != lEDblink.value;
 	newValue |= _masterMultiLed.LowBattery != lowBattery;
 	newValue |= _masterMultiLed.AcInputConfiguration != lED_AcInputConfiguration;
-	newValue |= _masterMultiLed.MinimumInputCurrentLimitA != minimumInputCurrentLimit;
-	newValue |= _masterMultiLed.MaximumInputCurrentLimitA != maximumInputCurrentLimit;
-	newValue |= _masterMultiLed.ActualInputCurrentLimitA != actualInputCurrentLimit;
+	newValue |= exceedsDeadband(NotifyField::LedMinimumInputCurrentLimit, minimumInputCurrentLimit, _masterMultiLed.MinimumInputCurrentLimitA);
+	newValue |= exceedsDeadband(NotifyField::LedMaximumInputCurrentLimit, maximumInputCurrentLimit, _masterMultiLed.MaximumInputCurrentLimitA);
+	newValue |= exceedsDeadband(NotifyField::LedActualInputCurrentLimit, actualInputCurrentLimit, _masterMultiLed.ActualInputCurrentLimitA);
 	newValue |= _masterMultiLed.SwitchRegister != switchRegister;
 
-	if (newValue)
+	if (publishDue(NotifyGroup::NotifyMasterMultiLed, newValue, _publishedMs[NotifyGroup::NotifyMasterMultiLed]))
 	{
 		xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
 		_masterMultiLed.LEDon.value = lEDon.value;
@@ -917,7 +2273,7 @@ void VEBus::decodeMasterMultiLed(std::vector<uint8_t>& buffer)
 	}
 }
 
-void VEBus::decodeInfoFrame(std::vector<uint8_t>& buffer)
+void VEBus::decodeInfoFrame(Buffer& buffer)
 {
 	switch (buffer[9])
 	{
@@ -937,25 +2293,34 @@ void VEBus::decodeInfoFrame(std::vector<uint8_t>& buffer)
 		info.InverterVoltage = convertRamVarToValueSigned(RamVariables::UBat, (buffer[15] << 8 | buffer[14]));
 		info.InverterCurrent = convertRamVarToValueSigned(RamVariables::IInverterRMS, (buffer[17] << 8 | buffer[16])) * buffer[6]; // buffer[6] -> Inverter factor
 		//info.MainFrequency = convertSettingToValue(Settings::RepeatedAbsorptionTime,buffer[18]);
+		int32_t rawValues[] = { (int16_t)(buffer[11] << 8 | buffer[10]), (int16_t)(buffer[13] << 8 | buffer[12]), (int16_t)(buffer[15] << 8 | buffer[14]), (int16_t)(buffer[17] << 8 | buffer[16]), buffer[5], buffer[6] };
 
 		xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
 		bool phaseInfoFound = false;
-		for (auto& element : _acInfo) {
+		for (uint8_t i = 0; i < _acInfo.size(); i++) {
+			AcInfo& element = _acInfo[i];
 			if (info.Phase != element.Phase) continue;
 			phaseInfoFound = true;
-			if (info == element)
-			{
-				xSemaphoreGive(_semaphoreStatus);
-				return;
-			}
+			aggregateAcInfo(i, info);
+			if (i < VEBUS_PHASE_COUNT) _acHistory[i].Add(millis(), rawValues);
+			bool newValue = false;
+			newValue |= info.State != element.State;
+			newValue |= exceedsDeadband(NotifyField::AcMainVoltage, info.MainVoltage, element.MainVoltage);
+			newValue |= exceedsDeadband(NotifyField::AcMainCurrent, info.MainCurrent, element.MainCurrent);
+			newValue |= exceedsDeadband(NotifyField::AcInverterVoltage, info.InverterVoltage, element.InverterVoltage);
+			newValue |= exceedsDeadband(NotifyField::AcInverterCurrent, info.InverterCurrent, element.InverterCurrent);
+			if ((i >= VEBUS_PHASE_COUNT) || !publishDue(NotifyGroup::NotifyAcInfo, newValue, _acPublishedMs[i])) break;
 			element = info;
 			element.newInfo = true;
 			break;
 		}
 
-		if (phaseInfoFound == false)
+		if ((phaseInfoFound == false) && (_acInfo.size() < VEBUS_PHASE_COUNT))
 		{
 			info.newInfo = true;
+			_acPublishedMs[_acInfo.size()] = millis();
+			aggregateAcInfo(_acInfo.size(), info);
+			_acHistory[_acInfo.size()].Add(millis(), rawValues);
 			_acInfo.push_back(info);
 		}
 		xSemaphoreGive(_semaphoreStatus);
@@ -968,8 +2333,15 @@ void VEBus::decodeInfoFrame(std::vector<uint8_t>& buffer)
 		info.CurrentInverting = convertRamVarToValueSigned(RamVariables::IBat, (buffer[12] | (buffer[13] << 8) | (buffer[14] << 16)));
 		info.CurrentCharging = convertRamVarToValueSigned(RamVariables::IBat, (buffer[15] | (buffer[16] << 8) | (buffer[17] << 16)));
 		//info.InverterFrequency = 1 / convertSettingToValue(Settings::RepeatedAbsorptionTime, buffer[18]) * 10;
+		aggregateDcInfo(info);
+		int32_t rawValues[] = { (int16_t)(buffer[11] << 8 | buffer[10]), (int16_t)(buffer[12] | (buffer[13] << 8) | (buffer[14] << 16)), (int16_t)(buffer[15] | (buffer[16] << 8) | (buffer[17] << 16)) };
+		_dcHistory.Add(millis(), rawValues);
 
-		if (info == _dcInfo) break;
+		bool newValue = false;
+		newValue |= exceedsDeadband(NotifyField::DcVoltage, info.Voltage, _dcInfo.Voltage);
+		newValue |= exceedsDeadband(NotifyField::DcCurrentInverting, info.CurrentInverting, _dcInfo.CurrentInverting);
+		newValue |= exceedsDeadband(NotifyField::DcCurrentCharging, info.CurrentCharging, _dcInfo.CurrentCharging);
+		if (!publishDue(NotifyGroup::NotifyDcInfo, newValue, _publishedMs[NotifyGroup::NotifyDcInfo])) break;
 		info.newInfo = true;
 		xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
 		_dcInfo = info;
@@ -979,169 +2351,499 @@ void VEBus::decodeInfoFrame(std::vector<uint8_t>& buffer)
 	default:
 		break;
 	}
-	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+}
+
+//Real-time task: frames bytes, recognizes sync and sends the staged request.
+//Everything else is done by the decode task, the reply to a sync does not depend on decoding time.
+void VEBus::commandHandling()
+{
+	if (!_communitationIsRunning) return;
+
+	if (_communitationIsResumed)
+	{
+		_communitationIsResumed = false;
+		_serial.flush(false);
+	}
+
+	if (_receiveResync)
+	{
+		_receiveResync = false;
+		while (_serial.available() > 0) _serial.read();
+		_receiveBuffer.clear();
+	}
+
+	int nr = _serial.available();
+	updateStatsWindow(nr);
+	if (nr == 0) return;
+
+	_serial.read(rxbuf, nr);
+	uint32_t rxTimeUs = micros();
+	for (int n = 0; n < nr; n++)
+	{
+		if (_receiveBuffer.size() >= VEBUS_MAX_FRAME_SIZE)
+		{
+			_receiveBuffer.clear();
+			_counters.rxDrops++;
+		}
+		_receiveBuffer.push_back(rxbuf[n]);
+		if (_receiveBuffer.back() != END_OF_FRAME) continue;
+
+		bool sync = (_receiveBuffer.size() == 10) && (_receiveBuffer[0] == MP_ID_0) && (_receiveBuffer[1] == MP_ID_1) && (_receiveBuffer[2] == SYNC_FRAME) && (_receiveBuffer[4] == SYNC_BYTE);
+		uint8_t frameNr = (_receiveBuffer.size() > 3) ? _receiveBuffer[3] : 0;
+		pushDecodeQueue(_receiveBuffer.data(), _receiveBuffer.size(), rxTimeUs, false);
+		_receiveBuffer.clear();
+		if (!sync) continue;
+
+		_statsWindowSyncs++;
+		if (_txStaged.load(std::memory_order_relaxed))
+		{
+			if (n != nr - 1)
+			{
+				_counters.tooLate++;
+				logEvent(LogLevel::Warning, LogEvent::LogTooLate);
+			}
+			else if (!takeBusBudget()) _counters.throttled++;
+			else sendStagedFrame(frameNr);
+		}
+
+		TaskHandle_t waiter = _gapWaiter.exchange(NULL);
+		if (waiter != NULL) xTaskNotifyGive(waiter);
+	}
+}
+
+//Real-time task
+void VEBus::pushDecodeQueue(const uint8_t* data, size_t size, uint32_t timeUs, bool sent)
+{
+	RawFrame frame;
+	frame.timeUs = timeUs;
+	frame.sent = sent;
+	frame.size = (size < VEBUS_MAX_FRAME_SIZE) ? size : VEBUS_MAX_FRAME_SIZE;
+	memcpy(frame.data, data, frame.size);
+	//A lost sent marker is recovered by decodeHandling() through _txSent
+	if (!_decodeQueue.push(frame) && !sent)
+	{
+		_counters.rxDrops++;
+		return;
+	}
+
+	TaskHandle_t task = _decodeTask;
+	if (task != NULL) xTaskNotifyGive(task);
+}
+
+//Real-time task. Only the frame number and the checksum are added, the frame is prepared by stageRequest()
+void VEBus::sendStagedFrame(uint8_t frameNr)
+{
+	if (!_txStaged.exchange(false, std::memory_order_acquire)) return;
+
+	_txFrame.data[3] = NEXT_FRAME_NR(frameNr);
+	size_t size = VEBusFrameCodec::AppendChecksum(_txFrame.data, _txFrame.size, sizeof(_txFrame.data));
+
+#ifndef UART_MODE_RS485
+	digitalWrite(_rePin, HIGH);
+#endif
+	_serial.write(_txFrame.data, size);
+#ifndef UART_MODE_RS485
+	_serial.flush();
+	digitalWrite(_rePin, LOW);
+#endif
+
+	_counters.txFrames++;
+	_counters.txBytes += size;
+	_statsWindowBytes += size;
+	_statsWindowSentSyncs++;
+	_slotTokens -= 100;
+	_byteTokens -= size;
+	//Hands _txFrame back to the decode task. The flag cannot be lost like the marker in the full decode queue
+	_txSentSize = size;
+	_txSentUs = micros();
+	_txSent.store(true, std::memory_order_release);
+	pushDecodeQueue(_txFrame.data, 0, _txSentUs, true);
+}
+
+//Decode task
+void VEBus::decodeHandling()
+{
+	drainSubmissions();
+	if (millis() - _garbageCollectorMs >= GARBAGE_COLLECTOR_INTERVAL)
+	{
+		_garbageCollectorMs = millis();
+		garbageCollector();
+		completeResponses();
+	}
+
+	//The sent marker keeps the order to the received frames, without it the flag is taken afterwards
+	while (_decodeQueue.pop(_decodeFrame))
+	{
+		if (!_decodeFrame.sent) decodeFrame(_decodeFrame);
+		else if (_txSent.exchange(false, std::memory_order_acquire)) confirmSent();
+	}
+	if (_txSent.exchange(false, std::memory_order_acquire)) confirmSent();
+
+	drainSubmissions();
+	stageRequest();
+	if (_monitoring) monitoringCycle();
+}
+
+//Decode task
+void VEBus::decodeFrame(RawFrame& frame)
+{
+	Buffer& buffer = _decodeBuffer;
+	buffer.resize(frame.size);
+	memcpy(buffer.data(), frame.data, frame.size);
+
+	ReceiveMode receiveMode = _receiveMode;
+	bool saveToReceiveRing = (receiveMode != ReceiveMode::ReceiveNone);
+
+	for (size_t i = 0; saveToReceiveRing && (i < _whitelistSize); i++)
+	{
+		saveToReceiveRing = false;
+		if (_whitelist[i].at > buffer.size()) continue;
+		if (_whitelist[i].value != buffer[_whitelist[i].at]) continue;
+
+		saveToReceiveRing = true;
+		break;
+	}
+
+	for (size_t i = 0; i < _blacklistSize; i++)
+	{
+		if (_blacklist[i].at > buffer.size()) continue;
+		if (_blacklist[i].value != buffer[_blacklist[i].at]) continue;
+
+		saveToReceiveRing = false;
+		break;
+	}
+
+	if (saveToReceiveRing && (receiveMode == ReceiveMode::ReceiveBuffer)) pushReceiveRing(buffer, frame.timeUs);
+	DestuffingFAtoFF(buffer);
+	if (saveToReceiveRing && (receiveMode == ReceiveMode::ReceiveView)) pushReceiveRing(buffer, frame.timeUs);
+	countFrame(buffer);
+	_decodeTimeUs = frame.timeUs;
+	decodeVEbusFrame(buffer);
+}
+
+//Decode task. The staged request went out, its frame number counts for the sequence check
+void VEBus::confirmSent()
+{
+	_stagedPending = false;
+	_lastFrameNr = _txFrame.data[3];
+	logFrame(LogLevel::Debug, LogEvent::LogRequest, _txFrame.data, _txSentSize);
+
+	for (uint8_t i = 0; i < _dataFifo.size(); i++)
+	{
+		Data& data = _dataFifo[i];
+		if (!data.staged) continue;
+		data.staged = false;
+		data.IsSent = true;
+		data.sentTimeMs = millis();
+		if (!data.trace.sent)
+		{
+			data.trace.sent = true;
+			data.trace.sentUs = _txSentUs;
+		}
+		if (!data.responseExpected)
+		{
+			_dataFifo.erase(_dataFifo.begin() + i);
+			fifoChanged(true);
+		}
+		break;
+	}
+}
+
+//Decode task. Prepares the next ready request, the real-time task sends it at the next free sync
+void VEBus::stageRequest()
+{
+	if (_stagedPending) return;
+
+	for (uint8_t i = 0; i < _dataFifo.size();) {
+		Data& data = _dataFifo[i];
+		if (!readyToSend(data)) {
+			i++;
+			continue;
+		}
 
-	xSemaphoreGive(_semaphoreStatus);
+		_txBuffer = data.requestData;
+		prepareCommand(_txBuffer, 0);
+		stuffingFAtoFF(_txBuffer);
+		//Stuffing failed (buffer too small without heap) or no room for checksum and end of frame, the request can never be sent
+		if ((_txBuffer.size() <= 4) || (_txBuffer.size() + 3 > sizeof(_txFrame.data)))
+		{
+			logEvent(LogLevel::Warning, LogEvent::LogDeleted, data.id, data.command);
+			releaseIds(data);
+			_dataFifo.erase(_dataFifo.begin() + i);
+			fifoChanged(true);
+			continue;
+		}
+
+		memcpy(_txFrame.data, _txBuffer.data(), _txBuffer.size());
+		_txFrame.size = _txBuffer.size();
+		data.staged = true;
+		if (!data.trace.staged)
+		{
+			data.trace.staged = true;
+			data.trace.stagedUs = micros();
+		}
+		_stagedPending = true;
+		_stagedMs = millis();
+		_txStaged.store(true, std::memory_order_release);
+		return;
+	}
 }
 
-//Runs on core 0
-void VEBus::commandHandling()
+//Decode task, before a staged request is changed or removed.
+//If the real-time task already took it, the request is sent as staged and confirmSent() finds no owner
+void VEBus::revokeStaged(Data& data)
 {
-	if (!_communitationIsRunning) return;
+	if (!data.staged) return;
+	data.staged = false;
+	if (_txStaged.exchange(false, std::memory_order_acquire)) _stagedPending = false;
+}
 
-	if (_communitationIsResumed)
+//Decode task, the only producer of the receive ring
+void VEBus::pushReceiveRing(Buffer& buffer, uint32_t timeUs)
+{
+	uint32_t head = _receiveHead.load(std::memory_order_relaxed);
+	if (head - _receiveTail.load(std::memory_order_acquire) >= VEBUS_RX_QUEUE_DEPTH)
 	{
-		_communitationIsResumed = false;
-		_serial.flush(false);
+		_counters.rxDrops++;
+		return;
 	}
 
-	int nr = _serial.available();
-	if (nr == 0) return;
+	ReceiveSlot& slot = _receiveRing[head & (VEBUS_RX_QUEUE_DEPTH - 1)];
+	slot.timeUs = timeUs;
+	slot.size = buffer.size();
+	memcpy(slot.data, buffer.data(), buffer.size());
+	_receiveHead.store(head + 1, std::memory_order_release);
+	notifyDispatcher();
+}
 
-	_serial.read(rxbuf, nr);
-	for (int n = 0; n < nr; n++)
+//The oldest slot stays owned by the consumer until releaseFrame(), the decode task does not overwrite it
+bool VEBus::borrowFrame(FrameView& view)
+{
+	uint32_t tail = _receiveTail.load(std::memory_order_relaxed);
+	if (tail == _receiveHead.load(std::memory_order_acquire)) return false;
+
+	ReceiveSlot& slot = _receiveRing[tail & (VEBUS_RX_QUEUE_DEPTH - 1)];
+	view.data = slot.data;
+	view.size = slot.size;
+	view.timeUs = slot.timeUs;
+	return true;
+}
+
+void VEBus::releaseFrame()
+{
+	_receiveTail.store(_receiveTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+//Decode task after every decodeHandling()
+//Light sleep as soon as the frames are received and no request waits for the bus or a response
+void VEBus::monitoringCycle()
+{
+	if (_monitorLatencyPending && (_receivedFrameTypes != 0))
 	{
-		_receiveBuffer.push_back(rxbuf[n]);
-		if (_receiveBuffer.back() != END_OF_FRAME) continue;
+		_monitorLatencyPending = false;
+		xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+		_monitoringStats.wakeLatencyUs = micros() - _monitorWakeUs;
+		if (_monitoringStats.wakeLatencyUs > _monitoringStats.wakeLatencyMaxUs) _monitoringStats.wakeLatencyMaxUs = _monitoringStats.wakeLatencyUs;
+		xSemaphoreGive(_semaphoreStatus);
+	}
 
-		bool saveToReceiveBufferList = true;
+	uint32_t now = millis();
+	bool received = (_receivedFrameTypes & _monitorFrameTypes) == _monitorFrameTypes;
+	bool listenElapsed = now - _monitorWakeMs >= _monitorMaxListenMs;
+	if (!listenElapsed && (!received || requestsPending())) return;
 
-		for (size_t i = 0; i < _whitelistSize; i++)
-		{
-			saveToReceiveBufferList = false;
-			if (_whitelist[i].at > _receiveBuffer.size()) continue;
-			if (_whitelist[i].value != _receiveBuffer[_whitelist[i].at]) continue;
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	_monitoringStats.cycles++;
+	if (!received) _monitoringStats.incomplete++;
+	_monitoringStats.awakeMs += now - _monitorWakeMs;
+	xSemaphoreGive(_semaphoreStatus);
 
-			saveToReceiveBufferList = true;
-			break;
+	int32_t sleepMs = (int32_t)(_monitorWakeMs + _monitorIntervalMs - now);
+	if (sleepMs > 0)
+	{
+		esp_sleep_enable_timer_wakeup((uint64_t)sleepMs * 1000);
+		//With bus traffic the UART would wake the chip at once
+		bool uartWakeup = (_receivedFrameTypes == 0);
+		if (uartWakeup)
+		{
+			uart_set_wakeup_threshold(uartNumber(), 3);
+			esp_sleep_enable_uart_wakeup(uartNumber());
 		}
+		_serial.flush();
 
-		for (size_t i = 0; i < _blacklistSize; i++)
-		{
-			if (_blacklist[i].at > _receiveBuffer.size()) continue;
-			if (_blacklist[i].value != _receiveBuffer[_blacklist[i].at]) continue;
+		uint32_t sleepStartUs = micros();
+		esp_light_sleep_start();
+		uint32_t sleptMs = (micros() - sleepStartUs) / 1000;
+		bool uartWoken = (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UART);
+		xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+		_monitoringStats.sleepMs += sleptMs;
+		if (uartWoken) _monitoringStats.uartWakeups++;
+		xSemaphoreGive(_semaphoreStatus);
+		esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
 
-			saveToReceiveBufferList = false;
-			break;
-		}
+		//Bytes received around the sleep are incomplete frames
+		_receiveResync = true;
+		_lastFrameNrValid = false;
+		TaskHandle_t task = _communicationTask;
+		if (task != NULL) xTaskNotifyGive(task);
+	}
 
-		xSemaphoreTake(_semaphoreReceiveData, portMAX_DELAY);
-		if (_receiveBufferList.size() < 10 && saveToReceiveBufferList) {
-			_receiveBufferList.push_back(_receiveBuffer);
-		}
-		xSemaphoreGive(_semaphoreReceiveData);
+	_monitorWakeMs = millis();
+	_monitorWakeUs = micros();
+	_monitorLatencyPending = true;
+	_receivedFrameTypes = 0;
+}
 
-		DestuffingFAtoFF(_receiveBuffer);
-		auto messageType = decodeVEbusFrame(_receiveBuffer);
-		_receiveBuffer.clear();
+//Decode task
+bool VEBus::requestsPending()
+{
+	if (_submissionHeld || !_submitQueue.empty()) return true;
+	if (_stagedPending) return true;
+	for (auto& data : _dataFifo) {
+		if (data.responseExpected && data.IsSent) return true;
+		if (readyToSend(data)) return true;
+	}
+	return false;
+}
 
-		if (messageType == ReceivedMessageType::Unknown)
-		{
-		}
+uart_port_t VEBus::uartNumber()
+{
+	if (&_serial == &Serial1) return UART_NUM_1;
+#if SOC_UART_NUM > 2
+	if (&_serial == &Serial2) return UART_NUM_2;
+#endif
+	return UART_NUM_0;
+}
 
-		if (messageType == ReceivedMessageType::sync)
-		{
-			if (_dataFifo.empty()) continue;
-			if ((n != nr - 1))
-			{
-				//Not the best idea to log on core 0
-				if (_logLevel >= LogLevel::Warning) Serial.println("too late");
-				continue;
-			}
+//Decode task
+void VEBus::countFrame(Buffer& buffer)
+{
+	if (buffer.size() < 5)
+	{
+		_counters.frames[FrameType::FrameOther]++;
+		return;
+	}
 
-			uint8_t frameNr = _receiveBuffer[3];
-			xSemaphoreTake(_semaphoreDataFifo, portMAX_DELAY);
-			uint32_t i = 0;
-			bool dataToSend = false;
-			for (i = 0; i < _dataFifo.size(); i++)
-			{
-				if (_dataFifo[i].IsSent == false)
-				{
-					dataToSend = true;
-					break;
-				}
-			}
+	//Every frame on the bus, from any master or device, takes the next frame number
+	if ((buffer[2] == DATA_FRAME) || (buffer[2] == SYNC_FRAME))
+	{
+		if (_lastFrameNrValid && (buffer[3] != _lastFrameNr) && (buffer[3] != NEXT_FRAME_NR(_lastFrameNr))) _counters.sequenceGaps++;
+		_lastFrameNr = buffer[3];
+		_lastFrameNrValid = true;
+	}
 
-			if (!dataToSend)
+	FrameType type = FrameType::FrameOther;
+	if ((buffer[0] == MP_ID_0) && (buffer[1] == MP_ID_1))
+	{
+		if (buffer[2] == SYNC_FRAME) type = FrameType::FrameSync;
+		else if (buffer[2] == DATA_FRAME)
+		{
+			switch (buffer[4])
 			{
-				xSemaphoreGive(_semaphoreDataFifo);
-				continue;
+			case 0x00: type = FrameType::FrameWinmon; break;
+			case 0x20: type = FrameType::FrameInfo; break;
+			case 0x41: type = FrameType::FrameLed; break;
+			case 0x70: type = FrameType::FrameBattery; break;
+			case 0x80: type = FrameType::FrameChargerInverter; break;
+			case 0xE4: type = FrameType::FramePhase; break;
 			}
+		}
+	}
+	else if ((buffer[0] == MK3_ID_0) && (buffer[1] == MK3_ID_1)) type = FrameType::FrameMaster;
 
-			Data& data = _dataFifo.at(i);
-			sendData(data, frameNr);
+	_receivedFrameTypes |= 1UL << type;
+	_counters.frames[type]++;
+}
 
-			if (data.responseExpected == false) _dataFifo.erase(_dataFifo.begin() + i);
+//Real-time task
+void VEBus::updateStatsWindow(uint32_t bytes)
+{
+	_counters.rxBytes += bytes;
+	_statsWindowBytes += bytes;
 
-			xSemaphoreGive(_semaphoreDataFifo);
-		}
-	}
+	uint32_t elapsed = millis() - _statsWindowStartMs;
+	if (elapsed < 1000) return;
+
+	//10 bits per byte (8N1)
+	_counters.bytesPerSecond = (uint64_t)_statsWindowBytes * 1000 / elapsed;
+	_counters.busUtilization = (uint64_t)_statsWindowBytes * 10 * 100 * 1000 / ((uint64_t)VEBUS_BAUD * elapsed);
+	_counters.ownSlotShare = (_statsWindowSyncs > 0) ? _statsWindowSentSyncs * 100 / _statsWindowSyncs : 0;
+	_statsWindowBytes = 0;
+	_statsWindowSyncs = 0;
+	_statsWindowSentSyncs = 0;
+	_statsWindowStartMs += elapsed;
 }
 
-void VEBus::sendData(VEBus::Data& data, uint8_t& frameNr)
+//Real-time task at every sync with data to send.
+//Slot tokens grow by slotShare per sync (100 = one slot), byte tokens by bytesPerSecond.
+//sendStagedFrame() takes the tokens, a frame may overdraw the byte bucket.
+bool VEBus::takeBusBudget()
 {
-	Data sendData = data;
-	prepareCommand(sendData.requestData, frameNr);
-	stuffingFAtoFF(sendData.requestData);
-	appendChecksum(sendData.requestData);
+	uint32_t now = millis();
+	uint32_t elapsed = now - _budgetRefillMs;
+	_budgetRefillMs = now;
 
-	uint8_t* buffer = &sendData.requestData[0];
+	_slotTokens += _budgetSlotShare;
+	if (_slotTokens > 200) _slotTokens = 200;
 
-#ifndef UART_MODE_RS485
-	digitalWrite(_rePin, HIGH);
-#endif
-	_serial.write(buffer, sendData.requestData.size());
-#ifndef UART_MODE_RS485
-	_serial.flush();
-	digitalWrite(_rePin, LOW);
-#endif
+	if (_budgetBytesPerSecond > 0)
+	{
+		int32_t burst = (_budgetBytesPerSecond / 4 > VEBUS_MAX_FRAME_SIZE) ? _budgetBytesPerSecond / 4 : VEBUS_MAX_FRAME_SIZE;
+		_byteTokens += (uint64_t)_budgetBytesPerSecond * elapsed / 1000;
+		if (_byteTokens > burst) _byteTokens = burst;
+	}
+	else _byteTokens = 0;
 
-	data.sentTimeMs = millis();
-	data.IsSent = true;
-	data.IsLogged = false;
+	if (_slotTokens < 100) return false;
+	if (_budgetBytesPerSecond > 0 && _byteTokens <= 0) return false;
+	if (_budgetMaxUtilization < 100 && _counters.busUtilization > _budgetMaxUtilization) return false;
+	return true;
 }
 
-void VEBus::checkResponseMessage()
+//Returns true if a response was handled
+bool VEBus::checkResponseMessage()
 {
-	bool dataToSave = false;
 	Data data;
-	xSemaphoreTake(_semaphoreDataFifo, portMAX_DELAY);
-	for (uint8_t i = 0; i < _dataFifo.size();)
-	{
-		if (_dataFifo[i].responseData.size() == 0) {
-			i++;
-			continue;
-		}
-
-		if (_dataFifo[i].expectedResponseCode == 0)
-		{
-		}
+	if (!_completionQueue.pop(data)) return false;
+	uint32_t takenUs = micros();
+	saveResponseData(data);
+	if (_latencyEnabled && !data.trace.waiter) recordLatency(data, takenUs, micros());
+	releaseId(data.id);
+	return true;
+}
 
-		if (_dataFifo[i].responseData[6] == _dataFifo[i].expectedResponseCode)
+void VEBus::recordLatency(const Data& data, uint32_t takenUs, uint32_t doneUs)
+{
+	const RequestTrace& trace = data.trace;
+	xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
+	LatencyTrace* latency = nullptr;
+	for (uint8_t i = 0; (_latency != nullptr) && (i < VEBUS_LATENCY_COMMANDS); i++)
+	{
+		if (i == _latencyCommands)
 		{
-			data = _dataFifo[i];
-			dataToSave = true;
-			_dataFifo.erase(_dataFifo.begin() + i);
-			break;
-		}
-
-		if (_dataFifo[i].resendCount >= MAX_RESEND) {
-			_dataFifo.erase(_dataFifo.begin() + i);
-			break;
-		}
-		else {
-			_dataFifo[i].resendCount++;
-			_dataFifo[i].IsSent = false;
-			_dataFifo[i].sentTimeMs = millis();
-			break;
+			_latency[i].command = data.command;
+			_latencyCommands++;
 		}
+		if (_latency[i].command != data.command) continue;
+		latency = &_latency[i];
+		break;
 	}
-	xSemaphoreGive(_semaphoreDataFifo);
 
-	if (dataToSave) saveResponseData(data);
+	if (latency != nullptr)
+	{
+		VEBusHistogram* stages = latency->stages;
+		if (trace.staged) stages[LatencyStage::LatencyQueued].Add(trace.stagedUs - trace.enqueuedUs);
+		if (trace.staged && trace.sent) stages[LatencyStage::LatencyBusWait].Add(trace.sentUs - trace.stagedUs);
+		if (trace.sent && trace.received) stages[LatencyStage::LatencyDevice].Add(trace.receivedUs - trace.sentUs);
+		if (trace.received) stages[LatencyStage::LatencyDecode].Add(trace.completedUs - trace.receivedUs);
+		stages[LatencyStage::LatencyDispatch].Add(takenUs - trace.completedUs);
+		stages[LatencyStage::LatencyCallback].Add(doneUs - takenUs);
+		stages[LatencyStage::LatencyTotal].Add(doneUs - trace.enqueuedUs);
+	}
+	xSemaphoreGive(_semaphoreStatus);
 }
 
-void VEBus::saveResponseData(Data data)
+void VEBus::saveResponseData(const Data& data)
 {
 	bool callResponseCb = false;
 	ResponseData responseData;
@@ -1149,12 +2851,21 @@ void VEBus::saveResponseData(Data data)
 	responseData.command = data.command;
 	responseData.address = data.address;
 
+	if ((data.responseData.size() >= 7) && (data.responseData[6] != 0) && (data.responseData[6] == unsupportedResponseCode(data.command)))
+	{
+		logEvent(LogLevel::Information, LogEvent::LogNotSupported, data.command, data.address);
+		responseData.error = RequestError::NotSupported;
+		deliverResponse(responseData, _handlers[data.id & 0x7F]);
+		logFrame(LogLevel::Debug, LogEvent::LogResponse, data.responseData.data(), data.responseData.size());
+		return;
+	}
+
 	switch (data.command)
 	{
 	case VEBusDefinition::SendSoftwareVersionPart0:
 	{
 		if (data.responseData.size() != 19) {
-			if (_logLevel >= LogLevel::Warning) Serial.printf("SendSoftwareVersionPart0 wrong size %d\n", data.responseData.size());
+			logEvent(LogLevel::Warning, LogEvent::LogWrongSize, data.command, data.responseData.size());
 			break;
 		}
 		callResponseCb = true;
@@ -1168,7 +2879,7 @@ void VEBus::saveResponseData(Data data)
 		break;
 	case VEBusDefinition::GetSetDeviceState:
 		if (data.responseData.size() != 11) {
-			if (_logLevel >= LogLevel::Warning) Serial.printf("GetSetDeviceState wrong size %d\n", data.responseData.size());
+			logEvent(LogLevel::Warning, LogEvent::LogWrongSize, data.command, data.responseData.size());
 			break;
 		}
 		callResponseCb = true;
@@ -1179,79 +2890,45 @@ void VEBus::saveResponseData(Data data)
 	case VEBusDefinition::ReadRAMVar:
 	{
 		if (data.responseData.size() != 11) {
-			if (_logLevel >= LogLevel::Warning) Serial.printf("ReadRAMVar wrong size %d\n", data.responseData.size());
+			logEvent(LogLevel::Warning, LogEvent::LogWrongSize, data.command, data.responseData.size());
 			break;
 		}
 		callResponseCb = true;
-		responseData.dataType = _ramVarInfoList[data.address].dataType;
-		uint16_t UnsignedRawValue = (((uint16_t)data.responseData[8] << 8) | data.responseData[7]);
-		int16_t signedRawValueint = ((int16_t)data.responseData[8] << 8) | data.responseData[7];
-		if (!_ramVarInfoList[data.address].available) break;
-		switch (_ramVarInfoList[data.address].dataType)
-		{
-		case VEBusDefinition::none:
-			break;
-		case VEBusDefinition::floatingPoint:
-			if (_ramVarInfoList[data.address].Scale < 0) responseData.valueFloat = convertRamVarToValueSigned((RamVariables)data.address, signedRawValueint);
-			else responseData.valueFloat = convertRamVarToValue((RamVariables)data.address, UnsignedRawValue);
-
-			responseData.valueFloat += _ramVarInfoList[data.address].Offset;
-			break;
-		case VEBusDefinition::unsignedInteger:
-			responseData.valueUint32 = UnsignedRawValue;
-			break;
-		case VEBusDefinition::signedInteger:
-			responseData.valueUint32 = signedRawValueint;
-			break;
-		default:
-			break;
-		}
-		
+		uint16_t rawValue = (((uint16_t)data.responseData[8] << 8) | data.responseData[7]);
+		updateValueCache(_ramVarCache[data.address], rawValue);
+		decodeRamVarValue((RamVariables)data.address, rawValue, responseData);
 		break;
 	}
 	case VEBusDefinition::ReadSetting:
 	{
 		if (data.responseData.size() != 11) {
-			if (_logLevel >= LogLevel::Warning) Serial.printf("ReadSetting wrong size %d\n", data.responseData.size());
+			logEvent(LogLevel::Warning, LogEvent::LogWrongSize, data.command, data.responseData.size());
 			break;
 		}
 		callResponseCb = true;
-		responseData.dataType = _settingInfoList[data.address].dataType;
-		uint16_t rawValue;
-		rawValue = ((uint16_t)data.responseData[8] << 8) | data.responseData[7];
-		if (!_settingInfoList[data.address].available) break;
-		switch (_settingInfoList[data.address].dataType)
-		{
-		case VEBusDefinition::none:
-			break;
-		case VEBusDefinition::floatingPoint:
-			responseData.valueFloat = convertSettingToValue((Settings)data.address, rawValue);
-			break;
-		case VEBusDefinition::unsignedInteger:
-			responseData.valueUint32 = rawValue;
-			break;
-		default:
-			break;
-		}
-		
+		uint16_t rawValue = ((uint16_t)data.responseData[8] << 8) | data.responseData[7];
+		updateValueCache(_settingCache[data.address], rawValue);
+		decodeSettingValue((Settings)data.address, rawValue, responseData);
 		break;
 	}
 	case VEBusDefinition::WriteRAMVar:
-		break;
 	case VEBusDefinition::WriteSetting:
+		xSemaphoreTake(_semaphoreCache, portMAX_DELAY);
+		updateWriteCache(data);
+		xSemaphoreGive(_semaphoreCache);
 		break;
 	case VEBusDefinition::WriteData:
 		break;
 	case VEBusDefinition::GetSettingInfo:
 		if (data.responseData.size() != 20) {
-			if (_logLevel >= LogLevel::Warning) Serial.printf("GetSettingInfo wrong size %d\n", data.responseData.size());
+			logEvent(LogLevel::Warning, LogEvent::LogWrongSize, data.command, data.responseData.size());
 			break;
 		}
 		saveSettingInfoData(data);
 		break;
 	case VEBusDefinition::GetRAMVarInfo:
 		if (data.responseData.size() != 13) {
-			if (_logLevel >= LogLevel::Warning) Serial.printf("GetRAMVarInfo wrong size %d\n", data.responseData.size());
+			logEvent(LogLevel::Warning, LogEvent::LogWrongSize, data.command, data.responseData.size());
 			break;
 		}
 		saveRamVarInfoData(data);
@@ -1259,23 +2936,158 @@ void VEBus::saveResponseData(Data data)
 	case VEBusDefinition::WriteViaID:
 		break;
 	case VEBusDefinition::ReadSnapShot:
+		saveSnapShotData(data);
 		break;
 	default:
 		break;
 	}
 
-	if (callResponseCb)
+	if (callResponseCb) deliverResponse(responseData, _handlers[data.id & 0x7F]);
+
+	logFrame(LogLevel::Debug, LogEvent::LogResponse, data.responseData.data(), data.responseData.size());
+}
+
+//One response callback per snapshot variable, all with the id of the request
+void VEBus::saveSnapShotData(const Data& data)
+{
+	uint8_t size = data.requestData.size() - 3;
+	if ((data.requestData.size() < 4) || (size > MAX_SNAPSHOT_SIZE) || (data.responseData.size() != 9 + size * 2u)) {
+		logEvent(LogLevel::Warning, LogEvent::LogWrongSize, data.command, data.responseData.size());
+		return;
+	}
+
+	for (uint8_t i = 0; i < size; i++)
 	{
-		_onResponseCb(responseData);
+		RamVariables variable = (RamVariables)data.requestData[3 + i];
+		if (variable >= RamVariables::SizeOfRamVarStruct) continue;
+
+		ResponseData responseData;
+		responseData.id = data.id;
+		responseData.command = data.command;
+		responseData.address = variable;
+		uint16_t rawValue = ((uint16_t)data.responseData[8 + i * 2] << 8) | data.responseData[7 + i * 2];
+		updateValueCache(_ramVarCache[variable], rawValue);
+		decodeRamVarValue(variable, rawValue, responseData);
+		deliverResponse(responseData, _handlers[data.id & 0x7F]);
 	}
+}
 
-	if (_logLevel < LogLevel::Debug) return;
-	Serial.print("Res: ");
-	for (uint32_t j = 0; j < data.responseData.size(); j++) Serial.printf("%02X ", data.responseData[j]);
-	Serial.println();
+//Maintain(). The handler of the request replaces the response callback, observers get every value
+void VEBus::deliverResponse(ResponseData& responseData, ResponseHandler& handler)
+{
+	if (handler) handler(responseData);
+	else _onResponseCb(responseData);
+
+	uint8_t observer = NoObserver;
+	if ((responseData.command == WinmonCommand::ReadRAMVar) || (responseData.command == WinmonCommand::ReadSnapShot))
+	{
+		if (responseData.address < RamVariables::SizeOfRamVarStruct) observer = _ramVarObservers[responseData.address];
+	}
+	else if (responseData.command == WinmonCommand::ReadSetting)
+	{
+		if (responseData.address < Settings::SizeOfSettingsStruct) observer = _settingObservers[responseData.address];
+	}
+
+	while (observer != NoObserver)
+	{
+		_observers[observer].handler(responseData);
+		observer = _observers[observer].next;
+	}
+}
+
+bool VEBus::AddObserver(RamVariables variable, ResponseHandler observer)
+{
+	if (variable >= RamVariables::SizeOfRamVarStruct) return false;
+	return addObserver(_ramVarObservers[variable], observer);
+}
+
+bool VEBus::AddObserver(Settings setting, ResponseHandler observer)
+{
+	if (setting >= Settings::SizeOfSettingsStruct) return false;
+	return addObserver(_settingObservers[setting], observer);
+}
+
+void VEBus::RemoveObservers(RamVariables variable)
+{
+	if (variable < RamVariables::SizeOfRamVarStruct) removeObservers(_ramVarObservers[variable]);
+}
+
+void VEBus::RemoveObservers(Settings setting)
+{
+	if (setting < Settings::SizeOfSettingsStruct) removeObservers(_settingObservers[setting]);
+}
+
+//A free observer has no handler. New observers are added in front of the list
+bool VEBus::addObserver(uint8_t& head, ResponseHandler& observer)
+{
+	if (!observer) return false;
+	for (uint8_t i = 0; i < VEBUS_OBSERVER_COUNT; i++)
+	{
+		if (_observers[i].handler) continue;
+		_observers[i].handler = observer;
+		_observers[i].next = head;
+		head = i;
+		return true;
+	}
+	return false;
+}
+
+void VEBus::removeObservers(uint8_t& head)
+{
+	while (head != NoObserver)
+	{
+		Observer& observer = _observers[head];
+		head = observer.next;
+		observer.handler.reset();
+		observer.next = NoObserver;
+	}
+}
+
+void VEBus::decodeRamVarValue(RamVariables variable, uint16_t rawValue, ResponseData& responseData)
+{
+	responseData.dataType = _ramVarInfoList[variable].dataType;
+	if (!_ramVarInfoList[variable].available) return;
+	switch (_ramVarInfoList[variable].dataType)
+	{
+	case VEBusDefinition::none:
+		break;
+	case VEBusDefinition::floatingPoint:
+		if (_ramVarInfoList[variable].Scale < 0) responseData.valueFloat = convertRamVarToValueSigned(variable, (int16_t)rawValue);
+		else responseData.valueFloat = convertRamVarToValue(variable, rawValue);
+
+		responseData.valueFloat += _ramVarInfoList[variable].Offset;
+		break;
+	case VEBusDefinition::unsignedInteger:
+		responseData.valueUint32 = rawValue;
+		break;
+	case VEBusDefinition::signedInteger:
+		responseData.valueUint32 = (int16_t)rawValue;
+		break;
+	default:
+		break;
+	}
+}
+
+void VEBus::decodeSettingValue(Settings setting, uint16_t rawValue, ResponseData& responseData)
+{
+	responseData.dataType = _settingInfoList[setting].dataType;
+	if (!_settingInfoList[setting].available) return;
+	switch (_settingInfoList[setting].dataType)
+	{
+	case VEBusDefinition::none:
+		break;
+	case VEBusDefinition::floatingPoint:
+		responseData.valueFloat = convertSettingToValue(setting, rawValue);
+		break;
+	case VEBusDefinition::unsignedInteger:
+		responseData.valueUint32 = rawValue;
+		break;
+	default:
+		break;
+	}
 }
 
-void VEBus::saveSettingInfoData(Data& data)
+void VEBus::saveSettingInfoData(const Data& data)
 {
 	SettingInfo settingInfo;
 	settingInfo.Scale = ((int16_t)data.responseData[8] << 8) | data.responseData[7];
@@ -1286,41 +3098,56 @@ void VEBus::saveSettingInfoData(Data& data)
 	settingInfo.AccessLevel = data.responseData[17];
 	_settingInfoList[data.address] = settingInfo;
 
-	if (_logLevel < LogLevel::Debug) return;
-	Serial.printf("SettingInfo %d, sc: %d, offset: %d, default: %d, min: %d, max: %d, access: %d\n", data.address, settingInfo.Scale, settingInfo.Offset, settingInfo.Default, settingInfo.Minimum, settingInfo.Maximum, settingInfo.AccessLevel);
+	logFrame(LogLevel::Debug, LogEvent::LogSettingInfo, data.responseData.data(), data.responseData.size(), data.address);
 }
 
-void VEBus::saveRamVarInfoData(Data& data)
+void VEBus::saveRamVarInfoData(const Data& data)
 {
 	RAMVarInfo ramVarInfo;
 	ramVarInfo.Scale = ((int16_t)data.responseData[8] << 8) | data.responseData[7];
 	ramVarInfo.Offset = ((int16_t)data.responseData[10] << 8) | data.responseData[9];
 	_ramVarInfoList[data.address] = ramVarInfo;
 
-	if (_logLevel < LogLevel::Debug) return;
-	Serial.printf("RamVarInfo %d, sc: %d, offset: %d\n", data.address, ramVarInfo.Scale, ramVarInfo.Offset);
+	logFrame(LogLevel::Debug, LogEvent::LogRamVarInfo, data.responseData.data(), data.responseData.size(), data.address);
 }
 
+//Decode task
 void VEBus::garbageCollector()
 {
+	recoverStaged();
+	if (_dataFifo.empty()) return;
 
-	xSemaphoreTake(_semaphoreDataFifo, portMAX_DELAY);
-	if (_dataFifo.empty()) {
-		xSemaphoreGive(_semaphoreDataFifo);
-		return;
-	}
-
+	size_t size = _dataFifo.size();
 	for (auto it = _dataFifo.begin(); it != _dataFifo.end();)
 	{
+		//WriteAddress whose WriteData could not be submitted
+		if (it->waitForData && (takeRevoked(it->id) || (millis() - it->sentTimeMs > RESPONSE_TIMEOUT)))
+		{
+			logEvent(LogLevel::Warning, LogEvent::LogDeleted, it->id, it->command);
+			it = _dataFifo.erase(it);
+			continue;
+		}
+
+		//write held back by the rate limit
+		if (!it->IsSent && (int32_t)(millis() - it->sendAfterMs) < 0)
+		{
+			++it;
+			continue;
+		}
+
 		if (millis() - it->sentTimeMs > RESPONSE_TIMEOUT)
 		{
-			if (_logLevel >= LogLevel::Warning) Serial.printf("Timeout id: %d command %d resend count: %d\n", it->id, it->command, it->resendCount);
+			_counters.timeouts++;
+			logEvent(LogLevel::Warning, LogEvent::LogTimeout, it->id, it->command, it->resendCount);
 			if (it->resendCount >= MAX_RESEND) {
+				logEvent(LogLevel::Warning, LogEvent::LogDeleted, it->id, it->command);
+				releaseIds(*it);
+				revokeStaged(*it);
 				it = _dataFifo.erase(it);
-				if (_logLevel >= LogLevel::Warning) Serial.println("The message is deleted.");
 				continue;
 			}
 			else {
+				_counters.resends++;
 				it->resendCount++;
 				it->IsSent = false;
 				it->sentTimeMs = millis();
@@ -1330,39 +3157,154 @@ void VEBus::garbageCollector()
 		}
 		else ++it;
 	}
-	xSemaphoreGive(_semaphoreDataFifo);
+	fifoChanged(_dataFifo.size() < size);
 }
 
-void VEBus::logging()
+//Decode task. The real-time task took the staged request but no confirmation arrived,
+//the request counts as sent and is resent after the response timeout
+void VEBus::recoverStaged()
 {
-	if (_logLevel < LogLevel::Debug) return;
+	if (!_stagedPending || _txStaged.load(std::memory_order_acquire) || _txSent.load(std::memory_order_acquire)) return;
+	if (millis() - _stagedMs <= RESPONSE_TIMEOUT) return;
 
-	xSemaphoreTake(_semaphoreDataFifo, portMAX_DELAY);
-	if (!_dataFifo.empty())
+	_stagedPending = false;
+	for (auto& data : _dataFifo)
 	{
-		if (_dataFifo[0].IsSent && !_dataFifo[0].IsLogged)
-		{
-			_dataFifo[0].IsLogged = true;
-			Serial.print("Req: ");
-			for (uint32_t i = 0; i < _dataFifo[0].requestData.size(); i++) Serial.printf("%02X ", _dataFifo[0].requestData[i]);
-			Serial.println();
-
-		}
+		if (!data.staged) continue;
+		logEvent(LogLevel::Warning, LogEvent::LogTimeout, data.id, data.command, data.resendCount);
+		data.staged = false;
+		data.IsSent = true;
+		data.sentTimeMs = millis();
 	}
-	xSemaphoreGive(_semaphoreDataFifo);
+}
+
+void VEBus::logging()
+{
+	if (_logLevel < LogLevel::Debug) return;
 
 	if (_masterMultiLedNewData && !_masterMultiLedLogged) {
 		xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
 		_masterMultiLedLogged = true;
 		xSemaphoreGive(_semaphoreStatus);
-		Serial.println("new _masterMultiLed data");
+		logEvent(LogLevel::Debug, LogEvent::LogNewMasterMultiLed);
 	}
 
-	if (_masterMultiLedNewData && !_multiPlusStatusLogged) {
+	if (_multiPlusStatusNewData && !_multiPlusStatusLogged) {
 		xSemaphoreTake(_semaphoreStatus, portMAX_DELAY);
 		_multiPlusStatusLogged = true;
 		xSemaphoreGive(_semaphoreStatus);
-		Serial.println("new _multiPlusStatus data");
+		logEvent(LogLevel::Debug, LogEvent::LogNewMultiPlusStatus);
+	}
+}
+
+//Lock-free, can be called from both bus tasks and with semaphores taken
+void VEBus::logEvent(LogLevel level, LogEvent event, int32_t arg0, int32_t arg1, int32_t arg2)
+{
+	if (_logLevel < level) return;
+	LogRecord record;
+	record.timeUs = micros();
+	record.event = event;
+	record.size = 0;
+	record.args[0] = arg0;
+	record.args[1] = arg1;
+	record.args[2] = arg2;
+	if (!_logQueue.push(record)) _counters.logDrops++;
+}
+
+void VEBus::logFrame(LogLevel level, LogEvent event, const uint8_t* data, size_t size, int32_t arg0)
+{
+	if (_logLevel < level) return;
+	LogRecord record;
+	record.timeUs = micros();
+	record.event = event;
+	record.size = (size < VEBUS_LOG_DATA_SIZE) ? size : VEBUS_LOG_DATA_SIZE;
+	record.args[0] = arg0;
+	record.args[1] = size;
+	record.args[2] = 0;
+	memcpy(record.data, data, record.size);
+	if (!_logQueue.push(record)) _counters.logDrops++;
+}
+
+void VEBus::printLog()
+{
+	LogRecord record;
+	char text[32 + VEBUS_LOG_DATA_SIZE * 3];
+	while (_logQueue.pop(record))
+	{
+		if (_onLogCb) {
+			_onLogCb(record);
+			continue;
+		}
+		FormatLogRecord(record, text, sizeof(text));
+		Serial.println(text);
+	}
+
+	uint32_t drops = _counters.logDrops;
+	if (drops == _logDropsReported) return;
+	if (!_onLogCb) Serial.printf("%lu log records lost\n", (unsigned long)(drops - _logDropsReported));
+	_logDropsReported = drops;
+}
+
+size_t VEBus::FormatLogRecord(const LogRecord& record, char* buffer, size_t size)
+{
+	if (size == 0) return 0;
+	buffer[0] = 0;
+	size_t length = 0;
+	auto append = [&](int written) {
+		if (written > 0) length += written;
+		if (length >= size) length = size - 1;
+	};
+
+	append(snprintf(buffer, size, "[%lu.%06lu] ", (unsigned long)(record.timeUs / 1000000), (unsigned long)(record.timeUs % 1000000)));
+	switch (record.event)
+	{
+	case LogEvent::LogTooLate:
+		append(snprintf(buffer + length, size - length, "too late"));
+		break;
+	case LogEvent::LogRequest:
+		append(snprintf(buffer + length, size - length, "Req: "));
+		break;
+	case LogEvent::LogResponse:
+		append(snprintf(buffer + length, size - length, "Res: "));
+		break;
+	case LogEvent::LogWrongSize:
+		append(snprintf(buffer + length, size - length, "Command 0x%02X wrong size %ld", (unsigned)record.args[0], (long)record.args[1]));
+		break;
+	case LogEvent::LogTimeout:
+		append(snprintf(buffer + length, size - length, "Timeout id: %ld command %ld resend count: %ld", (long)record.args[0], (long)record.args[1], (long)record.args[2]));
+		break;
+	case LogEvent::LogDeleted:
+		append(snprintf(buffer + length, size - length, "The message is deleted. id: %ld command %ld", (long)record.args[0], (long)record.args[1]));
+		break;
+	case LogEvent::LogDropped:
+		append(snprintf(buffer + length, size - length, "The message is dropped, fifo full. id: %ld command %ld priority %ld", (long)record.args[0], (long)record.args[1], (long)record.args[2]));
+		break;
+	case LogEvent::LogNotSupported:
+		append(snprintf(buffer + length, size - length, "Not supported command 0x%02X address %ld", (unsigned)record.args[0], (long)record.args[1]));
+		break;
+	case LogEvent::LogSettingInfo:
+		if (record.size < 18) break;
+		append(snprintf(buffer + length, size - length, "SettingInfo %ld, sc: %d, offset: %d, default: %u, min: %u, max: %u, access: %u", (long)record.args[0],
+			(int16_t)((record.data[8] << 8) | record.data[7]), (int16_t)((record.data[10] << 8) | record.data[9]), (uint16_t)((record.data[12] << 8) | record.data[11]),
+			(uint16_t)((record.data[14] << 8) | record.data[13]), (uint16_t)((record.data[16] << 8) | record.data[15]), record.data[17]));
+		return length;
+	case LogEvent::LogRamVarInfo:
+		if (record.size < 11) break;
+		append(snprintf(buffer + length, size - length, "RamVarInfo %ld, sc: %d, offset: %d", (long)record.args[0],
+			(int16_t)((record.data[8] << 8) | record.data[7]), (int16_t)((record.data[10] << 8) | record.data[9])));
+		return length;
+	case LogEvent::LogNewMasterMultiLed:
+		append(snprintf(buffer + length, size - length, "new _masterMultiLed data"));
+		break;
+	case LogEvent::LogNewMultiPlusStatus:
+		append(snprintf(buffer + length, size - length, "new _multiPlusStatus data"));
+		break;
+	default:
+		append(snprintf(buffer + length, size - length, "event %u", record.event));
+		break;
 	}
+
+	for (uint8_t i = 0; i < record.size; i++) append(snprintf(buffer + length, size - length, "%02X ", record.data[i]));
+	return length;
 }
 
@@ -14,14 +14,89 @@
 #include "hal/uart_types.h"
 #endif
 
+//Fixed capacities, no heap allocations after Setup()
+//#define VEBUS_NO_HEAP
+
+//Count global operator new calls, see VEBus::GetAllocationCount()
+//#define VEBUS_COUNT_ALLOCATIONS
+
+#ifndef VEBUS_REQUEST_POOL_SIZE
+#define VEBUS_REQUEST_POOL_SIZE 48
+#endif
+#ifndef VEBUS_RX_QUEUE_DEPTH
+#define VEBUS_RX_QUEUE_DEPTH 16        //received frames for Maintain(), power of two
+#endif
+#ifndef VEBUS_MAX_FRAME_SIZE
+#define VEBUS_MAX_FRAME_SIZE 64
+#endif
+#ifndef VEBUS_PHASE_COUNT
+#define VEBUS_PHASE_COUNT 7
+#endif
+#ifndef VEBUS_CALLBACK_SIZE
+#define VEBUS_CALLBACK_SIZE 16
+#endif
+#ifndef VEBUS_SUBMIT_DEPTH
+#define VEBUS_SUBMIT_DEPTH 16       //requests not yet taken over by the decode task, power of two
+#endif
+#ifndef VEBUS_INFLIGHT_INDEX_SIZE
+#define VEBUS_INFLIGHT_INDEX_SIZE 64 //hash index of shareable requests, power of two above VEBUS_REQUEST_POOL_SIZE
+#endif
+#ifndef VEBUS_SHARED_WAITERS
+#define VEBUS_SHARED_WAITERS 4      //further callers answered by one shared request
+#endif
+#ifndef VEBUS_OBSERVER_COUNT
+#define VEBUS_OBSERVER_COUNT 16     //observers of all variables and settings together
+#endif
+#ifndef VEBUS_COMPLETION_DEPTH
+#define VEBUS_COMPLETION_DEPTH 16   //responses for Maintain(), power of two
+#endif
+#ifndef VEBUS_DECODE_DEPTH
+#define VEBUS_DECODE_DEPTH 32       //frames from the real-time task to the decode task, power of two
+#endif
+#ifndef VEBUS_TASK_PRIORITY
+#define VEBUS_TASK_PRIORITY 10      //real-time task (framing, sync, send) on core 0
+#endif
+#ifndef VEBUS_DECODE_PRIORITY
+#define VEBUS_DECODE_PRIORITY 2     //decode task, below the real-time task
+#endif
+#ifndef VEBUS_DECODE_CORE
+#define VEBUS_DECODE_CORE 0
+#endif
+#ifndef VEBUS_LATENCY_COMMANDS
+#define VEBUS_LATENCY_COMMANDS 4    //commands with latency histograms, see SetLatencyTracing()
+#endif
+#ifndef VEBUS_LOG_DEPTH
+#define VEBUS_LOG_DEPTH 32          //log records, power of two
+#endif
+#ifndef VEBUS_LOG_DATA_SIZE
+#define VEBUS_LOG_DATA_SIZE 24      //frame bytes per log record
+#endif
+
 #include <vector>
+#include <atomic>
+#include <functional>
 #include "VEBusDefinition.h"
+#include "VEBusContainer.h"
+#include "VEBusFrameCodec.h"
+#include "VEBusHistory.h"
+#include "VEBusHistogram.h"
 
 using namespace VEBusDefinition;
 
 class VEBus
 {
 public:
+#ifdef VEBUS_NO_HEAP
+    template <typename T, size_t Capacity> using List = VEBusContainer::StaticVector<T, Capacity>;
+    template <typename Signature> using Function = VEBusContainer::InlineFunction<Signature, VEBUS_CALLBACK_SIZE>;
+    template <typename T, size_t Capacity> using HotList = VEBusContainer::StaticVector<T, Capacity>;
+#else
+    template <typename T, size_t Capacity> using List = std::vector<T>;
+    template <typename T, size_t Capacity> using HotList = std::vector<T, VEBusContainer::CapsAllocator<T, VEBUS_HOT_CAPS>>;
+    template <typename Signature> using Function = std::function<Signature>;
+#endif
+    typedef List<uint8_t, VEBUS_MAX_FRAME_SIZE> Buffer;
+
     enum LogLevel
     {
         None,
@@ -30,6 +105,18 @@ public:
         Debug
     };
 
+    enum RequestError
+    {
+        Success,
+        FifoFull,
+        OutsideLowerRange,
+        OutsideUpperRange,
+        ConvertError,
+        Unchanged,
+        Cached,
+        NotSupported            //the device answered 0x90 / 0x91, later requests fail without bus traffic
+    };
+
     struct ResponseData
     {
         uint8_t id;
@@ -39,6 +126,7 @@ public:
         uint32_t valueUint32;
         int32_t valueint32;
         ResponseDataType dataType;
+        RequestError error = RequestError::Success;
     };
 
     struct Blacklist
@@ -53,13 +141,26 @@ public:
         uint8_t at;
     };
 
-    enum RequestError
+    //Used by the DropLowestPriority overflow policy, derived from the command
+    enum RequestPriority : uint8_t
     {
-        Success,
-        FifoFull,
-        OutsideLowerRange,
-        OutsideUpperRange,
-        ConvertError
+        PriorityLow,            //info requests, software version
+        PriorityNormal,         //reads
+        PriorityHigh            //writes, switch and device state
+    };
+
+    enum OverflowPolicy
+    {
+        RejectNew,              //Read/Write return 0 (RequestError::FifoFull)
+        DropLowestPriority      //an unsent request of lower priority is dropped
+    };
+
+    //Read-only view into a slot of the receive ring, valid until the callback returns
+    struct FrameView
+    {
+        const uint8_t* data;    //destuffed frame
+        size_t size;
+        uint32_t timeUs;        //micros() when the frame was read from the UART
     };
 
     struct RequestResult
@@ -68,29 +169,222 @@ public:
         RequestError error;
     };
 
+    enum FrameType
+    {
+        FrameSync,
+        FrameWinmon,             //0x00 response
+        FrameInfo,               //0x20
+        FrameLed,                //0x41
+        FrameBattery,            //0x70
+        FrameChargerInverter,    //0x80
+        FramePhase,              //0xE4
+        FrameMaster,             //request of a bus master (MK3, Venus OS)
+        FrameOther,
+        SizeOfFrameTypes
+    };
+
+    struct Statistics
+    {
+        uint32_t frames[FrameType::SizeOfFrameTypes];
+        uint32_t txFrames;
+        uint32_t txBytes;
+        uint32_t rxBytes;
+        uint32_t bytesPerSecond;        //received and sent, last second
+        uint8_t busUtilization;         //% of VE.Bus baudrate, last second
+        uint8_t ownSlotShare;           //% of sync slots used by this library, last second
+        uint32_t throttled;             //sync slots skipped by the bus budget
+        uint32_t sequenceGaps;          //missing frame numbers
+        uint32_t rxDrops;               //receive callback queue full or frame too long
+        uint32_t rxOverflows;           //UART fifo or buffer overflow, e.g. while the flash cache was off
+        uint32_t requestQueueDepth;
+        uint32_t requestQueueHighWater;
+        uint32_t resends;
+        uint32_t timeouts;
+        uint32_t tooLate;               //sync received with more data pending, slot missed
+        uint32_t stackHighWaterMark;    //unused bytes of the vebus_task stack
+        uint32_t heapFree;
+        uint32_t heapMinimumFree;
+        uint32_t logDrops;              //log records lost, log queue full
+        uint32_t requestsDropped;       //dropped for a request of higher priority
+        uint32_t requestsShared;        //answered by an identical request already in the fifo
+    };
+
+    struct MonitoringStats
+    {
+        uint32_t cycles;
+        uint32_t incomplete;            //listen time elapsed before all frame types were received
+        uint32_t uartWakeups;           //woken by bus traffic instead of the timer
+        uint32_t awakeMs;
+        uint32_t sleepMs;
+        float dutyCycle;                //% of time awake
+        uint32_t wakeLatencyUs;         //last wakeup until the first received frame
+        uint32_t wakeLatencyMaxUs;
+    };
+
+    //Request timestamps: enqueue, first staged for a sync, sent, response received,
+    //passed to Maintain(), taken by Maintain(), callback returned
+    enum LatencyStage : uint8_t
+    {
+        LatencyQueued,          //enqueue until first staged (fifo, rate limit, priority)
+        LatencyBusWait,         //staged until sent (sync, bus budget)
+        LatencyDevice,          //sent until response received, resends included
+        LatencyDecode,          //response received until passed to Maintain()
+        LatencyDispatch,        //waiting for Maintain()
+        LatencyCallback,        //response callback, handler and observers
+        LatencyTotal,
+        SizeOfLatencyStages
+    };
+
+    struct LatencyPercentiles
+    {
+        uint32_t count;
+        uint32_t p50Us;
+        uint32_t p95Us;
+        uint32_t p99Us;
+        uint32_t maxUs;
+        uint64_t sumUs;
+    };
+
+    struct LatencyReport
+    {
+        uint8_t command;
+        LatencyPercentiles stages[LatencyStage::SizeOfLatencyStages];
+    };
+
+    enum LogEvent : uint8_t
+    {
+        LogTooLate,             //sync slot missed
+        LogRequest,             //data: sent frame
+        LogResponse,            //data: response frame
+        LogWrongSize,           //args: command, size
+        LogTimeout,             //args: id, command, resend count
+        LogDeleted,             //args: id, command
+        LogDropped,             //args: id, command, priority
+        LogNotSupported,        //args: command, address
+        LogSettingInfo,         //args: setting, data: response frame
+        LogRamVarInfo,          //args: variable, data: response frame
+        LogNewMasterMultiLed,
+        LogNewMultiPlusStatus
+    };
+
+    //Binary log record, formatted later on the application core
+    struct LogRecord
+    {
+        uint32_t timeUs;
+        LogEvent event;
+        uint8_t size;           //bytes in data, frames are truncated to VEBUS_LOG_DATA_SIZE
+        int32_t args[3];
+        uint8_t data[VEBUS_LOG_DATA_SIZE];
+    };
+
     friend void communication_task(void* handler_args);
+    friend void decode_task(void* handler_args);
+    friend void dispatcher_task(void* handler_args);
+    friend class VEBusBenchmark;
 
     VEBus(HardwareSerial& serial, int8_t rxPin, int8_t txPin, int8_t rePin);
     ~VEBus();
 
+    //*new VEBus(...) places the object (request queues, frame buffers) with VEBUS_HOT_CAPS,
+    //*large allocations would otherwise go to PSRAM on boards with PSRAM. Returns nullptr if no heap is free
+    static void* operator new(size_t size) noexcept;
+    static void* operator new(size_t, void* place) noexcept { return place; }
+    static void operator delete(void* p);
+
     void Setup(bool autostart = true);
-    void Maintain();
+    //*Calls the callbacks of all received responses and frames
+    //*budgetUs: returns after this time, the rest is done by the next call (0 = no limit)
+    void Maintain(uint32_t budgetUs = 0);
+
+    //*Own task instead of calling Maintain() in loop(), woken as soon as a response or frame arrives.
+    //*The callbacks are called from this task. Maintain() does nothing while the dispatcher runs
+    bool StartDispatcher(uint8_t priority = 1, uint32_t stackSize = 4096, int8_t core = 1);
+    void StopDispatcher();
 
     void SetLogLevel(LogLevel level);
     LogLevel GetLogLevel();
 
-    void SetResponseCallback(std::function<void(ResponseData&)> cb);
-    void SetReceiveCallback(std::function<void(std::vector<uint8_t>& buffer)> cb);
-    void SetReceiveCallback(std::function<void(std::vector<uint8_t>& buffer)> cb, Blacklist* blacklist, size_t size);
-    void SetReceiveCallback(std::function<void(std::vector<uint8_t>& buffer)> cb, Whitelist* whitelist, size_t size);
+    typedef Function<void(ResponseData&)> ResponseCallback;
+    //Stored in the request, always inline storage (VEBUS_CALLBACK_SIZE bytes of captures)
+    typedef VEBusContainer::InlineFunction<void(ResponseData&), VEBUS_CALLBACK_SIZE> ResponseHandler;
+    typedef Function<void(Buffer& buffer)> ReceiveCallback;
+    typedef Function<void(const FrameView& frame)> FrameCallback;
+
+    typedef Function<void(LogRecord&)> LogCallback;
+    typedef Function<void(bool high, uint32_t size)> WatermarkCallback;
+
+    void SetResponseCallback(ResponseCallback cb);
+    void SetReceiveCallback(ReceiveCallback cb);
+    void SetReceiveCallback(ReceiveCallback cb, Blacklist* blacklist, size_t size);
+    void SetReceiveCallback(ReceiveCallback cb, Whitelist* whitelist, size_t size);
+    //*Instead of SetReceiveCallback: frames are passed destuffed and without copy,
+    //*the ring slot is reused as soon as the callback returns
+    void SetFrameCallback(FrameCallback cb);
+    void SetFrameCallback(FrameCallback cb, Blacklist* blacklist, size_t size);
+    void SetFrameCallback(FrameCallback cb, Whitelist* whitelist, size_t size);
+    //*Log records are queued lock-free and printed to Serial in Maintain(),
+    //*logging does not change the bus timing. With a callback the raw records are passed instead
+    void SetLogCallback(LogCallback cb);
+    //*Returns the length of the text
+    size_t FormatLogRecord(const LogRecord& record, char* buffer, size_t size);
 
     void StartCommunication();
     void StopCommunication();
+
+    //*Blocks until the next sync slot was served. NVS and OTA writes turn off the flash cache and stop
+    //*the bus tasks on both cores, a write started now has the whole gap to the next sync.
+    //*Only the start is in the gap, a longer write still delays the next sync
+    //*Returns false after timeoutMs, if communication is stopped or another task is waiting
+    bool WaitForBusGap(uint32_t timeoutMs);
+
+    //*Low-power monitoring: wakes every intervalMs and listens until every frame type in frameTypes
+    //*(mask of 1 << FrameType) is received and the queued requests are answered, at most maxListenMs.
+    //*Then the chip goes to light sleep, both cores sleep and loop() pauses as well.
+    //*Without bus traffic (device off) the chip also wakes up on UART activity
+    void StartMonitoring(uint32_t intervalMs, uint32_t frameTypes, uint32_t maxListenMs = 1000);
+    void StopMonitoring();
+    MonitoringStats GetMonitoringStats();
     uint32_t GetFifoSize();
+    uint32_t GetFifoCapacity();
+    //*Called from Maintain() when the fifo size reaches high and again when it falls to low (high = 0: off)
+    void SetFifoWatermarks(uint32_t high, uint32_t low, WatermarkCallback cb);
+    //*Read/Write wait up to timeoutMs for a free fifo entry instead of returning 0 (0 = no wait).
+    //*The task is woken by a task notification. Callbacks called by Maintain() should not wait,
+    //*the fifo is emptied by Maintain(). In the dispatcher task requests never wait
+    void SetSubmitTimeout(uint32_t timeoutMs);
+    void SetOverflowPolicy(OverflowPolicy policy);
+
+    //*Limits the bus share of this library to leave room for Venus OS and other masters.
+    //*slotShare: max % of sync slots, bytesPerSecond: max sent bytes (0 = no limit),
+    //*maxUtilization: no requests while the measured bus utilization is above this %
+    void SetBusBudget(uint8_t slotShare, uint32_t bytesPerSecond = 0, uint8_t maxUtilization = 100);
+
+    //*Learns request/response pairs of other bus masters (Venus OS) and uses their
+    //*values: value cache, response callback with id 0 and pending own reads
+    void SetPassiveHarvesting(bool enabled);
+
+    Statistics GetStats();
+    //*Writes the statistics in Prometheus text format, returns the length
+    size_t GetStatsPrometheus(char* buffer, size_t size);
+
+    //*Latency histograms of answered requests per command (the first VEBUS_LATENCY_COMMANDS commands)
+    //*and stage. Shared requests report the times of the first caller.
+    //*Allocates about 3 KB per command with VEBUS_COLD_CAPS. Returns false if allocation failed
+    bool SetLatencyTracing(bool enabled);
+    //*Returns the number of reports (commands with answered requests)
+    size_t GetLatency(LatencyReport* reports, size_t size);
+    void ResetLatency();
+
+    //*Write cache remembers the last value confirmed by the device.
+    //*Writes without effect are skipped (Returns 0 / RequestError::Unchanged)
+    //*and writes within the interval are merged into one write of the latest value.
+    void SetWriteCache(bool enabled);
+    void SetWriteRateLimit(uint32_t ramIntervalMs, uint32_t eepromIntervalMs);
+    void ClearWriteCache();
 
     //*Be careful when repeatedly writing EEPROM (loop)
-    //*EEPROM writes are limited
-    //*Returns 0 if failed
+    //*EEPROM writes are limited, use SetWriteRateLimit
+    //*Returns 0 if failed or unchanged
     uint8_t WriteViaID(RamVariables variable, int16_t rawValue, bool eeprom = false);
     uint8_t WriteViaID(RamVariables variable, uint16_t rawValue, bool eeprom = false);
     RequestResult WriteViaID(RamVariables variable, float value, bool eeprom = false);
@@ -108,15 +402,50 @@ public:
     uint8_t Read(RamVariables variable);
     uint8_t Read(RamVariables* variable, uint8_t size);
     uint8_t Read(Settings setting);
+    //*The response is passed to handler instead of the response callback
+    uint8_t Read(RamVariables variable, ResponseHandler handler);
+    uint8_t Read(Settings setting, ResponseHandler handler);
+
+    //*Read-through cache: a value younger than maxAgeMs is returned in data (RequestError::Cached)
+    //*without bus traffic, otherwise it is requested and the response arrives via callback
+    RequestResult Read(RamVariables variable, uint32_t maxAgeMs, ResponseData& data);
+    RequestResult Read(Settings setting, uint32_t maxAgeMs, ResponseData& data);
+
+    //*Snapshot of up to 6 RAM variables, captured at the same moment on the device
+    //*Every variable is reported by its own response callback with the snapshot id
+    bool SetSnapShot(RamVariables* variables, uint8_t size);
+    uint8_t ReadSnapShot();
+    uint8_t ReadSnapShot(ResponseHandler handler);
 
     uint8_t ReadInfo(RamVariables variable);
     uint8_t ReadInfo(Settings setting);
 
+    //*Negative cache: variables and settings the device answered as not supported (0x90 / 0x91).
+    //*Reads, writes and info requests of these fail at once (returns 0 / RequestError::NotSupported)
+    bool IsSupported(RamVariables variable, bool info = false);
+    bool IsSupported(Settings setting, bool info = false);
+    void ClearUnsupported();
+
+    //*Called with every value of the variable or setting: own reads, snapshots and harvested values,
+    //*in addition to the response callback or handler. Register and remove in the task that calls Maintain()
+    //*Returns false if all VEBUS_OBSERVER_COUNT observers are in use
+    bool AddObserver(RamVariables variable, ResponseHandler observer);
+    bool AddObserver(Settings setting, ResponseHandler observer);
+    void RemoveObservers(RamVariables variable);
+    void RemoveObservers(Settings setting);
+
     void SetSwitch(SwitchState state);
 
     RAMVarInfo GetRamVarInfo(RamVariables variable);
     SettingInfo GetSettingInfo(Settings setting);
 
+    //*A field counts as changed if it differs from the last published value by more than
+    //*absolute or relative * |last value|. Default 0/0: every change is published
+    void SetDeadband(NotifyField field, float absolute, float relative = 0);
+    //*minIntervalMs: changes are published at most once per interval
+    //*maxIntervalMs: published at least once per interval, also without change (0 = off)
+    void SetPublishInterval(NotifyGroup group, uint32_t minIntervalMs, uint32_t maxIntervalMs = 0);
+
     bool NewMasterMultiLedAvailable();
     MasterMultiLed GetMasterMultiLed();
 
@@ -129,83 +458,430 @@ public:
     uint8_t NewAcInfoAvailable();
     AcInfo GetAcInfo(uint8_t type);
 
+    //*Tumbling windows (up to 3, e.g. 1000, 10000, 60000 ms) over every DC and AC info frame
+    //*Get*Aggregate returns the last completed window, Count = 0 if none yet
+    bool SetAggregationWindows(uint32_t* windowsMs, uint8_t size);
+    DcAggregate GetDcAggregate(uint8_t window);
+    AcAggregate GetAcAggregate(uint8_t type, uint8_t window);
+
+    //*History of every DC and AC info frame, delta encoded (about 4-8 bytes per frame)
+    //*in PSRAM if available. dcBytes/acBytes per series, phases = number of recorded AC phases
+    //*Allocates memory, call it in setup(). Returns false if allocation failed
+    bool SetHistory(size_t dcBytes, size_t acBytes = 0, uint8_t phases = 1);
+    //*Mean per resolutionMs (0 = every frame) from fromMs to toMs (millis()), returns the number of samples
+    size_t GetDcHistory(uint32_t fromMs, uint32_t toMs, uint32_t resolutionMs, DcSample* samples, size_t size);
+    size_t GetAcHistory(uint8_t type, uint32_t fromMs, uint32_t toMs, uint32_t resolutionMs, AcSample* samples, size_t size);
+
     //Get VE.BUS Version
     uint8_t ReadSoftwareVersion();
     uint8_t CommandReadDeviceState();
 
-    void DestuffingFAtoFF(std::vector<uint8_t>& buffer);
+    void DestuffingFAtoFF(Buffer& buffer);
+
+#ifdef VEBUS_COUNT_ALLOCATIONS
+    //*Number of operator new calls since start, compare before and after a test run
+    static uint32_t GetAllocationCount();
+#endif
 
 private:
-    struct Data
+    struct RequestTrace
+    {
+        uint32_t enqueuedUs = 0;
+        uint32_t stagedUs = 0;
+        uint32_t sentUs = 0;
+        uint32_t receivedUs = 0;
+        uint32_t completedUs = 0;
+        bool staged = false;
+        bool sent = false;
+        bool received = false;
+        bool waiter = false;        //copy for a further caller of a shared request, not recorded
+    };
+
+    struct Data : VEBusContainer::CopyCounted<Data>
     {
         bool responseExpected;
         bool IsSent = false;
-        bool IsLogged = false;
         uint8_t id = 0;
-        uint8_t command;
-        uint8_t address;
+        uint8_t command = 0;
+        uint8_t address = 0;
         uint8_t expectedResponseCode = 0;
         uint32_t sentTimeMs;
+        uint32_t sendAfterMs = 0;
+        bool updateIfExist = true;
+        bool mergeWrite = false;
+        bool staged = false;            //copied to _txFrame, not yet confirmed as sent
+        bool waitForData = false;       //WriteAddress, not sent before its WriteData is submitted
+        bool indexed = false;           //in _inflightIndex, further callers can share it
+        uint32_t hash = 0;              //command, address and payload, without the ID
+        uint8_t waiterCount = 0;
+        uint8_t firstWaiter = 0;        //ID of a further caller, the others follow in _nextWaiter
+        RequestPriority priority = RequestPriority::PriorityNormal;
         uint32_t resendCount = 0;
-        std::vector<uint8_t> requestData;
-        std::vector<uint8_t> responseData;
+        RequestTrace trace;
+        Buffer requestData;
+        Buffer responseData;
         Data() : requestData(32), responseData(32){}
     };
 
+    enum ReceiveMode : uint8_t
+    {
+        ReceiveNone,
+        ReceiveBuffer,          //raw frame, copied for ReceiveCallback
+        ReceiveView             //destuffed frame, FrameCallback reads the slot
+    };
+
+    //Frame from the real-time task to the decode task
+    struct RawFrame
+    {
+        uint32_t timeUs;
+        bool sent;              //own request, sent at a sync
+        uint16_t size;
+        uint8_t data[VEBUS_MAX_FRAME_SIZE];
+    };
+
+    //Request prepared by the decode task, frame number and checksum are added at the sync
+    struct TxFrame
+    {
+        uint16_t size;
+        uint8_t data[VEBUS_MAX_FRAME_SIZE + 3];
+    };
+
+    struct ReceiveSlot
+    {
+        uint32_t timeUs;
+        uint16_t size;
+        uint8_t data[VEBUS_MAX_FRAME_SIZE];
+    };
+
+    //Written from both cores without lock
+    struct Counters
+    {
+        std::atomic<uint32_t> frames[FrameType::SizeOfFrameTypes] = {};
+        std::atomic<uint32_t> txFrames{ 0 };
+        std::atomic<uint32_t> txBytes{ 0 };
+        std::atomic<uint32_t> rxBytes{ 0 };
+        std::atomic<uint32_t> bytesPerSecond{ 0 };
+        std::atomic<uint32_t> busUtilization{ 0 };
+        std::atomic<uint32_t> ownSlotShare{ 0 };
+        std::atomic<uint32_t> throttled{ 0 };
+        std::atomic<uint32_t> sequenceGaps{ 0 };
+        std::atomic<uint32_t> rxDrops{ 0 };
+        std::atomic<uint32_t> rxOverflows{ 0 };
+        std::atomic<uint32_t> requestQueueHighWater{ 0 };
+        std::atomic<uint32_t> resends{ 0 };
+        std::atomic<uint32_t> timeouts{ 0 };
+        std::atomic<uint32_t> tooLate{ 0 };
+        std::atomic<uint32_t> logDrops{ 0 };
+        std::atomic<uint32_t> requestsDropped{ 0 };
+        std::atomic<uint32_t> requestsShared{ 0 };
+    };
+
+    struct ObservedRequest
+    {
+        bool valid = false;
+        uint8_t id = 0;
+        uint8_t command = 0;
+        uint8_t addressSize = 0;
+        uint8_t addresses[6];
+    };
+
+    struct HarvestedValue
+    {
+        uint8_t command;
+        uint8_t address;
+        uint16_t rawValue;
+    };
+
+    struct Deadband
+    {
+        float absolute = 0;
+        float relative = 0;
+    };
+
+    struct PublishInterval
+    {
+        uint32_t minMs = 0;
+        uint32_t maxMs = 0;
+    };
+
+    struct Accumulator
+    {
+        float min = 0;
+        float max = 0;
+        float sum = 0;
+        uint32_t count = 0;
+    };
+
+    struct DcWindow
+    {
+        uint32_t startMs = 0;
+        Accumulator voltage, currentInverting, currentCharging;
+        DcAggregate completed{};
+    };
+
+    struct AcWindow
+    {
+        uint32_t startMs = 0;
+        Accumulator mainVoltage, mainCurrent, inverterVoltage, inverterCurrent;
+        AcAggregate completed{};
+    };
+
+    struct LatencyTrace
+    {
+        uint8_t command;
+        VEBusHistogram stages[LatencyStage::SizeOfLatencyStages];
+    };
+
+    struct CacheEntry
+    {
+        bool valid = false;
+        bool eeprom = false;
+        uint16_t rawValue = 0;
+        uint32_t updatedMs = 0;
+        uint32_t nextWriteMs = 0;
+        uint8_t pendingWrites = 0;      //writes in the fifo or submitted, not yet acknowledged
+    };
+
     HardwareSerial& _serial;
-    SemaphoreHandle_t _semaphoreDataFifo;
+    SemaphoreHandle_t _semaphoreCache;
     SemaphoreHandle_t _semaphoreStatus;
-    SemaphoreHandle_t _semaphoreReceiveData;
     int8_t _rxPin, _txPin, _rePin;
-    uint8_t _id;
-    std::vector<Data> _dataFifo;
-    //Runs on core 0. not thread save.
-    std::vector<uint8_t> _receiveBuffer;
-    std::vector<std::vector<uint8_t>> _receiveBufferList;
+    //ID_1 0x80-0xFF, one bit per ID in use
+    std::atomic<uint8_t> _idCursor{ 0 };
+    std::atomic<uint32_t> _idsInUse[4] = {};
+    //WriteAddress whose WriteData could not be submitted, the decode task removes it and releases the ID
+    std::atomic<uint32_t> _idsRevoked[4] = {};
+    //Per ID, owned with the ID. The handler is set before the request is submitted and reset by releaseId()
+    ResponseHandler _handlers[128];
+    //Decode task, links the further callers of a shared request, 0 ends the list
+    uint8_t _nextWaiter[128] = {};
+    //Requests from any task, drained by the decode task
+    VEBusContainer::BoundedQueue<Data, VEBUS_SUBMIT_DEPTH> _submitQueue;
+    //Decode task only, no lock
+    HotList<Data, VEBUS_REQUEST_POOL_SIZE> _dataFifo;
+    std::atomic<uint32_t> _fifoSize{ 0 };
+    //Decode task, taken from _submitQueue and waiting for a free entry
+    Data _heldSubmission;
+    bool _submissionHeld = false;
+    //Backpressure
+    OverflowPolicy _overflowPolicy = OverflowPolicy::RejectNew;
+    uint32_t _submitTimeoutMs = 0;
+    std::atomic<TaskHandle_t> _submitWaiters[4] = {};
+    //Task in WaitForBusGap(), woken by the real-time task after a sync
+    std::atomic<TaskHandle_t> _gapWaiter{ NULL };
+    uint32_t _highWatermark = 0;
+    uint32_t _lowWatermark = 0;
+    std::atomic<bool> _aboveHighWatermark{ false };
+    std::atomic<bool> _watermarkChanged{ false };
+    WatermarkCallback _onWatermarkCb;
+    //Decode task. Hash of shareable requests to their ID, linear probing, ID 0 = empty
+    struct InflightSlot
+    {
+        uint32_t hash;
+        uint8_t id;
+    };
+    InflightSlot _inflightIndex[VEBUS_INFLIGHT_INDEX_SIZE] = {};
+    //Answered requests, from the decode task to Maintain()
+    VEBusContainer::BoundedQueue<Data, VEBUS_COMPLETION_DEPTH> _completionQueue;
+    //Real-time task only
+    VEBusContainer::StaticVector<uint8_t, VEBUS_MAX_FRAME_SIZE> _receiveBuffer;
+    volatile bool _receiveResync = false;
+    //Real-time task to decode task
+    VEBusContainer::BoundedQueue<RawFrame, VEBUS_DECODE_DEPTH> _decodeQueue;
+    //Staged request. Owned by the real-time task while _txStaged is set, otherwise by the decode task
+    TxFrame _txFrame;
+    std::atomic<bool> _txStaged{ false };
+    //Set by the real-time task after sending _txFrame, taken by the decode task
+    std::atomic<bool> _txSent{ false };
+    uint16_t _txSentSize = 0;
+    uint32_t _txSentUs = 0;
+    //Decode task, a staged request is not yet confirmed by the real-time task
+    bool _stagedPending = false;
+    uint32_t _stagedMs = 0;
+    Buffer _txBuffer;
+    RawFrame _decodeFrame;
+    //Receive time of the frame in decodeVEbusFrame()
+    uint32_t _decodeTimeUs = 0;
+    Buffer _decodeBuffer;
+    //Received frames, single producer (decode task), single consumer (Maintain)
+    ReceiveSlot _receiveRing[VEBUS_RX_QUEUE_DEPTH];
+    std::atomic<uint32_t> _receiveHead{ 0 };
+    std::atomic<uint32_t> _receiveTail{ 0 };
+    volatile ReceiveMode _receiveMode = ReceiveMode::ReceiveNone;
     SettingInfo _settingInfoList[Settings::SizeOfSettingsStruct] = { DefaultSettingInfoList };
     RAMVarInfo _ramVarInfoList[RamVariables::SizeOfRamVarStruct] = { DefaultRamVarInfoList };
+    uint8_t _snapShotVariables[6];
+    uint8_t _snapShotSize = 0;
     Blacklist _blacklist[20];
     size_t _blacklistSize = 0;
     Whitelist _whitelist[20];
     size_t _whitelistSize = 0;
-    std::vector<AcInfo> _acInfo;
+    //Last known device values. Protected by _semaphoreCache, not used by the bus tasks
+    CacheEntry _ramVarCache[RamVariables::SizeOfRamVarStruct];
+    CacheEntry _settingCache[Settings::SizeOfSettingsStruct];
+    //Negative cache, one bit per address. Set by the decode task, read by any task
+    enum UnsupportedKind : uint8_t
+    {
+        UnsupportedRamVar,
+        UnsupportedRamVarInfo,
+        UnsupportedSetting,
+        UnsupportedSettingInfo,
+        SizeOfUnsupportedKinds
+    };
+    std::atomic<uint32_t> _unsupported[SizeOfUnsupportedKinds][8] = {};
+    VEBusContainer::BoundedQueue<HarvestedValue, 16> _harvestQueue;
+    bool _writeCacheEnabled = false;
+    uint32_t _ramWriteIntervalMs = 0;
+    uint32_t _eepromWriteIntervalMs = 0;
+    List<AcInfo, VEBUS_PHASE_COUNT> _acInfo;
     DcInfo _dcInfo;
 
+    //Change notification, runs in the decode task
+    Deadband _deadbands[NotifyField::SizeOfNotifyFields];
+    PublishInterval _publishIntervals[NotifyGroup::SizeOfNotifyGroups];
+    uint32_t _publishedMs[NotifyGroup::SizeOfNotifyGroups] = {};
+    uint32_t _acPublishedMs[VEBUS_PHASE_COUNT] = {};
+
+    //Windowed aggregates, protected by _semaphoreStatus
+    uint32_t _aggregateWindowsMs[3] = {};
+    uint8_t _aggregateWindowSize = 0;
+    DcWindow _dcWindows[3];
+    AcWindow _acWindows[VEBUS_PHASE_COUNT][3];
+
+    //Raw values of info frames: DC {voltage, current inverting, current charging}
+    //AC {main voltage, main current, inverter voltage, inverter current, main factor, inverter factor}
+    VEBusHistory _dcHistory;
+    VEBusHistory _acHistory[VEBUS_PHASE_COUNT];
+
     MasterMultiLed _masterMultiLed;
     volatile bool _masterMultiLedNewData = false;
     volatile bool _masterMultiLedLogged = false;
 
+    //Latency histograms, protected by _semaphoreStatus. Updated by Maintain()
+    LatencyTrace* _latency = nullptr;
+    uint8_t _latencyCommands = 0;
+    volatile bool _latencyEnabled = false;
+
     MultiPlusStatus _multiPlusStatus;
     volatile bool _multiPlusStatusNewData = false;
     volatile bool _multiPlusStatusLogged = false;
 
     LogLevel _logLevel = LogLevel::None;
-
-    std::function<void(ResponseData&)> _onResponseCb;
-    std::function<void(std::vector<uint8_t>&)> _onReceiveCb;
+    VEBusContainer::BoundedQueue<LogRecord, VEBUS_LOG_DEPTH> _logQueue;
+    uint32_t _logDropsReported = 0;
+    LogCallback _onLogCb;
+
+    Counters _counters;
+    TaskHandle_t _communicationTask = NULL;
+    TaskHandle_t _decodeTask = NULL;
+    TaskHandle_t _dispatcherTask = NULL;
+    volatile bool _dispatcherRunning = false;
+    uint32_t _garbageCollectorMs = 0;
+    //Monitoring mode, runs in the decode task
+    volatile bool _monitoring = false;
+    uint32_t _monitorIntervalMs = 0;
+    uint32_t _monitorFrameTypes = 0;
+    uint32_t _monitorMaxListenMs = 0;
+    uint32_t _monitorWakeMs = 0;
+    uint32_t _monitorWakeUs = 0;
+    bool _monitorLatencyPending = false;
+    uint32_t _receivedFrameTypes = 0;
+    MonitoringStats _monitoringStats = {};      //protected by _semaphoreStatus
+    //Decode task
+    uint8_t _lastFrameNr = 0;
+    bool _lastFrameNrValid = false;
+    //Real-time task
+    uint32_t _statsWindowStartMs = 0;
+    uint32_t _statsWindowBytes = 0;
+    uint32_t _statsWindowSyncs = 0;
+    uint32_t _statsWindowSentSyncs = 0;
+
+    //Requests of other masters, runs on the decode task
+    bool _harvestingEnabled = false;
+    ObservedRequest _observedRequests[4];
+    uint8_t _observedRequestIndex = 0;
+
+    //Bus budget, token buckets refilled on the real-time task
+    uint8_t _budgetSlotShare = 100;
+    uint32_t _budgetBytesPerSecond = 0;
+    uint8_t _budgetMaxUtilization = 100;
+    int32_t _slotTokens = 0;
+    int32_t _byteTokens = 0;
+    uint32_t _budgetRefillMs = 0;
+
+    ResponseCallback _onResponseCb;
+    //Observers per variable and setting, linked lists in _observers. Only used by Maintain()
+    static const uint8_t NoObserver = 0xFF;
+    struct Observer
+    {
+        ResponseHandler handler;
+        uint8_t next = NoObserver;
+    };
+    Observer _observers[VEBUS_OBSERVER_COUNT];
+    uint8_t _ramVarObservers[RamVariables::SizeOfRamVarStruct];
+    uint8_t _settingObservers[Settings::SizeOfSettingsStruct];
+    ReceiveCallback _onReceiveCb;
+    FrameCallback _onFrameCb;
 
     bool _communitationIsRunning = false;
     volatile bool _communitationIsResumed = false;
 
 
-    void addOrUpdateFifo(Data data, bool updateIfExist = true);
+    bool addOrUpdateFifo(const Data& data, bool updateIfExist = true, bool wait = true);
+    RequestError addOrUpdateWrite(Data& data, CacheEntry& cache, uint16_t rawValue, bool eeprom);
+    RequestResult writeViaID(RamVariables variable, uint16_t rawValue, bool eeprom);
+    RequestResult writeViaID(Settings setting, uint16_t rawValue, bool eeprom);
+    CacheEntry* writeCacheEntry(const Data& data);
+    void updateWriteCache(const Data& data);
+    void abandonWrite(Data& data);
+    void scheduleWrite(Data& data);
+    void updateValueCache(CacheEntry& cache, uint16_t rawValue);
+    void setValueCache(CacheEntry& cache, uint16_t rawValue);
+    bool getCachedValue(CacheEntry& cache, uint32_t maxAgeMs, uint16_t& rawValue);
+    static int8_t unsupportedKind(uint8_t command);
+    static uint8_t unsupportedResponseCode(uint8_t command);
+    bool isUnsupported(uint8_t command, uint8_t address);
+    void setUnsupported(Data& data);
+    bool readyToSend(Data& data);
     bool getNextFreeId_1(uint8_t& id);
-
-    void prepareCommand(std::vector<uint8_t>& buffer, uint8_t frameNr);
-    void prepareCommandWriteViaID(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand, uint8_t address, int16_t value, StorageType storageType);
-    void prepareCommandWriteViaID(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand, uint8_t address, uint16_t value, StorageType storageType);
-    uint8_t prepareCommandReadMultiRAMVar(std::vector<uint8_t>& buffer, uint8_t id, uint8_t* addresses, uint8_t addressSize);
-    void prepareCommandReadSetting(std::vector<uint8_t>& buffer, uint8_t id, uint16_t address);
-    void prepareCommandWriteAddress(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand, uint16_t address);
-    void prepareCommandWriteData(std::vector<uint8_t>& buffer, uint8_t id, uint16_t value);
-    void prepareCommandReadInfo(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand, uint16_t setting);
-    void prepareCommandReadSoftwareVersion(std::vector<uint8_t>& buffer, uint8_t id, uint8_t winmonCommand);
-    void prepareCommandSetGetDeviceState(std::vector<uint8_t>& buffer, uint8_t id, CommandDeviceState command, uint8_t state = 0);
-
-    void prepareCommandSetSwitchState(std::vector<uint8_t>& buffer, SwitchState switchState);
-
-    void stuffingFAtoFF(std::vector<uint8_t>& buffer);
-    void appendChecksum(std::vector<uint8_t>& buffer);
+    void releaseId(uint8_t id);
+    void releaseIds(Data& data);
+    void revokeWriteAddress(uint8_t id);
+    bool takeRevoked(uint8_t id);
+    static bool isShareable(uint8_t command);
+    static uint32_t requestHash(const Data& data);
+    static bool sameRequest(Data& a, Data& b);
+    bool shareRequest(Data& data);
+    void indexRequest(Data& data);
+    void unindexRequest(Data& data);
+    static RequestPriority requestPriority(uint8_t command);
+    bool hasSpace(RequestPriority priority);
+    bool waitForSpace(RequestPriority priority);
+    void drainSubmissions();
+    bool takeSubmission(Data& data);
+    bool dropLowerPriority(RequestPriority priority);
+    void fifoChanged(bool freed);
+    void completeResponses();
+
+    void prepareCommand(Buffer& buffer, uint8_t frameNr);
+    void prepareCommandWriteViaID(Buffer& buffer, uint8_t id, uint8_t winmonCommand, uint8_t address, int16_t value, StorageType storageType);
+    void prepareCommandWriteViaID(Buffer& buffer, uint8_t id, uint8_t winmonCommand, uint8_t address, uint16_t value, StorageType storageType);
+    uint8_t prepareCommandReadMultiRAMVar(Buffer& buffer, uint8_t id, uint8_t* addresses, uint8_t addressSize);
+    void prepareCommandReadSnapShot(Buffer& buffer, uint8_t id, uint8_t* addresses, uint8_t addressSize);
+    void prepareCommandReadSetting(Buffer& buffer, uint8_t id, uint16_t address);
+    void prepareCommandWriteAddress(Buffer& buffer, uint8_t id, uint8_t winmonCommand, uint16_t address);
+    void prepareCommandWriteData(Buffer& buffer, uint8_t id, uint16_t value);
+    void prepareCommandReadInfo(Buffer& buffer, uint8_t id, uint8_t winmonCommand, uint16_t setting);
+    void prepareCommandReadSoftwareVersion(Buffer& buffer, uint8_t id, uint8_t winmonCommand);
+    void prepareCommandSetGetDeviceState(Buffer& buffer, uint8_t id, CommandDeviceState command, uint8_t state = 0);
+
+    void prepareCommandSetSwitchState(Buffer& buffer, SwitchState switchState);
+
+    void logEvent(LogLevel level, LogEvent event, int32_t arg0 = 0, int32_t arg1 = 0, int32_t arg2 = 0);
+    void logFrame(LogLevel level, LogEvent event, const uint8_t* data, size_t size, int32_t arg0 = 0);
+    void printLog();
+
+    void stuffingFAtoFF(Buffer& buffer);
 
     uint16_t convertRamVarToRawValue(RamVariables variable, float value);
     float convertRamVarToValue(RamVariables variable, uint16_t rawValue);
@@ -216,20 +892,56 @@ private:
     uint16_t convertSettingToRawValue(Settings setting, float value);
     float convertSettingToValue(Settings setting, uint16_t rawValue);
 
-    ReceivedMessageType decodeVEbusFrame(std::vector<uint8_t>& buffer);
-    void decodeChargerInverterCondition(std::vector<uint8_t>& buffer); //0x80
-    void decodeBatteryCondition(std::vector<uint8_t>& buffer); //0x70
-    void decodeMasterMultiLed(std::vector<uint8_t>& buffer); //0x41
-    void decodeInfoFrame(std::vector<uint8_t>& buffer); // 0x20
-
-    void saveSettingInfoData(Data& data);
-    void saveRamVarInfoData(Data& data);
+    ReceivedMessageType decodeVEbusFrame(Buffer& buffer);
+    void observeMasterRequest(Buffer& buffer);
+    void harvestResponse(Buffer& buffer);
+    bool harvestValue(uint8_t command, uint8_t address, uint16_t rawValue, uint8_t frameNr);
+    void callHarvestedValues();
+    void aggregateDcInfo(DcInfo& info);
+    void aggregateAcInfo(uint8_t index, AcInfo& info);
+    void accumulate(Accumulator& accumulator, float value);
+    Aggregate completeAccumulator(Accumulator& accumulator);
+    bool exceedsDeadband(NotifyField field, float value, float publishedValue);
+    bool publishDue(NotifyGroup group, bool changed, uint32_t& publishedMs);
+    void decodeChargerInverterCondition(Buffer& buffer); //0x80
+    void decodeBatteryCondition(Buffer& buffer); //0x70
+    void decodeMasterMultiLed(Buffer& buffer); //0x41
+    void decodeInfoFrame(Buffer& buffer); // 0x20
+
+    void saveSnapShotData(const Data& data);
+    void decodeRamVarValue(RamVariables variable, uint16_t rawValue, ResponseData& responseData);
+    void decodeSettingValue(Settings setting, uint16_t rawValue, ResponseData& responseData);
+    void saveSettingInfoData(const Data& data);
+    void saveRamVarInfoData(const Data& data);
     void commandHandling();
-
-    void sendData(VEBus::Data& data, uint8_t& frameNr);
-    void checkResponseMessage();
-    void saveResponseData(Data data);
+    void pushDecodeQueue(const uint8_t* data, size_t size, uint32_t timeUs, bool sent);
+    void sendStagedFrame(uint8_t frameNr);
+    void decodeHandling();
+    void decodeFrame(RawFrame& frame);
+    void confirmSent();
+    void recoverStaged();
+    void stageRequest();
+    void revokeStaged(Data& data);
+    void pushReceiveRing(Buffer& buffer, uint32_t timeUs);
+    bool borrowFrame(FrameView& view);
+    void releaseFrame();
+    void setBlacklist(Blacklist* blacklist, size_t size);
+    void setWhitelist(Whitelist* whitelist, size_t size);
+    void monitoringCycle();
+    bool requestsPending();
+    uart_port_t uartNumber();
+
+    void countFrame(Buffer& buffer);
+    void updateStatsWindow(uint32_t bytes);
+    bool takeBusBudget();
+    bool checkResponseMessage();
+    void saveResponseData(const Data& data);
+    void recordLatency(const Data& data, uint32_t takenUs, uint32_t doneUs);
+    void deliverResponse(ResponseData& responseData, ResponseHandler& handler);
+    bool addObserver(uint8_t& head, ResponseHandler& observer);
+    void removeObservers(uint8_t& head);
     void garbageCollector();
+    void notifyDispatcher();
     void logging();
 };
 #endif
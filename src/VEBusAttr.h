@@ -0,0 +1,15 @@
+// VEBusAttr.h
+
+#ifndef _VEBUSATTR_h
+#define _VEBUSATTR_h
+
+//Heap placement (esp_heap_caps.h capabilities). Hot buffers (request slots, the VEBus object) stay in
+//internal DRAM, cold and large structures (history) go to PSRAM. Both fall back to any 8-bit heap.
+#ifndef VEBUS_HOT_CAPS
+#define VEBUS_HOT_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+#ifndef VEBUS_COLD_CAPS
+#define VEBUS_COLD_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#endif
+
+#endif
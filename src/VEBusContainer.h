@@ -0,0 +1,330 @@
+// VEBusContainer.h
+
+#ifndef _VEBUSCONTAINER_h
+#define _VEBUSCONTAINER_h
+
+#include "arduino.h"
+
+#include <new>
+#include <utility>
+#include <cstddef>
+#include <type_traits>
+#include <atomic>
+#include "esp_heap_caps.h"
+#include "VEBusAttr.h"
+
+#ifdef VEBUS_COUNT_COPIES
+//Defined by the host benchmark, called with the size of every counted copy
+void VEBusCountCopy(size_t bytes);
+#endif
+
+namespace VEBusContainer
+{
+    //Subset of std::vector with inline storage.
+    //push_back/insert on a full list are ignored.
+    template <typename T, size_t Capacity>
+    class StaticVector
+    {
+    public:
+        typedef T value_type;
+        typedef T* iterator;
+        typedef const T* const_iterator;
+
+        StaticVector() : _size(0) {}
+        explicit StaticVector(size_t count) : _size(0) { resize(count); }
+        StaticVector(const StaticVector& other) : _size(0) { assign(other); }
+        ~StaticVector() { clear(); }
+
+        StaticVector& operator=(const StaticVector& other)
+        {
+            if (this != &other) assign(other);
+            return *this;
+        }
+
+        static size_t capacity() { return Capacity; }
+        void reserve(size_t) {}
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        bool full() const { return _size >= Capacity; }
+
+        T* data() { return reinterpret_cast<T*>(_storage); }
+        const T* data() const { return reinterpret_cast<const T*>(_storage); }
+        iterator begin() { return data(); }
+        iterator end() { return data() + _size; }
+        const_iterator begin() const { return data(); }
+        const_iterator end() const { return data() + _size; }
+
+        T& operator[](size_t i) { return data()[i]; }
+        const T& operator[](size_t i) const { return data()[i]; }
+        T& at(size_t i) { return data()[i]; }
+        T& front() { return data()[0]; }
+        T& back() { return data()[_size - 1]; }
+
+        void clear()
+        {
+            while (_size > 0) data()[--_size].~T();
+        }
+
+        void resize(size_t count)
+        {
+            if (count > Capacity) count = Capacity;
+            while (_size > count) data()[--_size].~T();
+            while (_size < count) new (&data()[_size++]) T();
+        }
+
+        void push_back(const T& value)
+        {
+            if (full()) return;
+            new (&data()[_size++]) T(value);
+        }
+
+        void pop_back()
+        {
+            if (_size > 0) data()[--_size].~T();
+        }
+
+        iterator insert(iterator pos, const T& value)
+        {
+            if (full()) return pos;
+            if (pos == end())
+            {
+                push_back(value);
+                return pos;
+            }
+
+            new (&data()[_size]) T(std::move(back()));
+            for (iterator it = end() - 1; it != pos; --it) *it = std::move(*(it - 1));
+            *pos = value;
+            ++_size;
+            return pos;
+        }
+
+        iterator erase(iterator pos)
+        {
+            for (iterator it = pos; it + 1 != end(); ++it) *it = std::move(*(it + 1));
+            pop_back();
+            return pos;
+        }
+
+    private:
+        void assign(const StaticVector& other)
+        {
+            clear();
+            for (size_t i = 0; i < other._size; i++) push_back(other[i]);
+        }
+
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type _storage[Capacity];
+        size_t _size;
+    };
+
+    //Callable with inline storage, never allocates.
+    //Captures must fit into Size bytes (checked at compile time).
+    template <typename Signature, size_t Size>
+    class InlineFunction;
+
+    template <typename R, typename... Args, size_t Size>
+    class InlineFunction<R(Args...), Size>
+    {
+    public:
+        InlineFunction() : _invoke(nullptr), _manage(nullptr) {}
+        InlineFunction(std::nullptr_t) : _invoke(nullptr), _manage(nullptr) {}
+
+        template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type>
+        InlineFunction(F&& f) : _invoke(nullptr), _manage(nullptr)
+        {
+            typedef typename std::decay<F>::type Functor;
+            static_assert(sizeof(Functor) <= Size, "callback capture too large, increase VEBUS_CALLBACK_SIZE");
+            static_assert(alignof(Functor) <= alignof(std::max_align_t), "callback alignment not supported");
+            new (&_storage) Functor(std::forward<F>(f));
+            _invoke = &invokeStub<Functor>;
+            _manage = &manageStub<Functor>;
+        }
+
+        InlineFunction(const InlineFunction& other) : _invoke(nullptr), _manage(nullptr) { assign(other); }
+        ~InlineFunction() { reset(); }
+
+        InlineFunction& operator=(const InlineFunction& other)
+        {
+            if (this != &other)
+            {
+                reset();
+                assign(other);
+            }
+            return *this;
+        }
+
+        void reset()
+        {
+            if (_manage) _manage(Operation::Destroy, &_storage, nullptr);
+            _invoke = nullptr;
+            _manage = nullptr;
+        }
+
+        explicit operator bool() const { return _invoke != nullptr; }
+
+        R operator()(Args... args) const
+        {
+            return _invoke(const_cast<void*>(static_cast<const void*>(&_storage)), std::forward<Args>(args)...);
+        }
+
+    private:
+        enum class Operation { Copy, Destroy };
+        typedef R(*Invoke)(void*, Args...);
+        typedef void(*Manage)(Operation, void*, const void*);
+
+        template <typename Functor>
+        static R invokeStub(void* storage, Args... args)
+        {
+            return (*static_cast<Functor*>(storage))(std::forward<Args>(args)...);
+        }
+
+        template <typename Functor>
+        static void manageStub(Operation operation, void* dst, const void* src)
+        {
+            if (operation == Operation::Copy) new (dst) Functor(*static_cast<const Functor*>(src));
+            else static_cast<Functor*>(dst)->~Functor();
+        }
+
+        void assign(const InlineFunction& other)
+        {
+            if (other._manage) other._manage(Operation::Copy, &_storage, &other._storage);
+            _invoke = other._invoke;
+            _manage = other._manage;
+        }
+
+        typename std::aligned_storage<Size, alignof(std::max_align_t)>::type _storage;
+        Invoke _invoke;
+        Manage _manage;
+    };
+
+    //Base of structs whose copies the host benchmark counts (VEBUS_COUNT_COPIES), empty otherwise
+    template <typename Derived>
+    struct CopyCounted
+    {
+#ifdef VEBUS_COUNT_COPIES
+        CopyCounted() {}
+        CopyCounted(const CopyCounted&) { VEBusCountCopy(sizeof(Derived)); }
+        CopyCounted& operator=(const CopyCounted&)
+        {
+            VEBusCountCopy(sizeof(Derived));
+            return *this;
+        }
+#endif
+    };
+
+    //heap_caps_malloc with the given capabilities, any 8-bit capable heap if that fails
+    inline void* CapsAllocate(size_t bytes, uint32_t caps)
+    {
+        void* p = heap_caps_malloc(bytes, caps);
+        if (p == nullptr) p = heap_caps_malloc(bytes, MALLOC_CAP_8BIT);
+        return p;
+    }
+
+    //std::vector allocator, places the storage with CapsAllocate (VEBUS_HOT_CAPS, VEBUS_COLD_CAPS)
+    template <typename T, uint32_t Caps>
+    class CapsAllocator
+    {
+    public:
+        typedef T value_type;
+        template <typename U> struct rebind { typedef CapsAllocator<U, Caps> other; };
+
+        CapsAllocator() {}
+        template <typename U> CapsAllocator(const CapsAllocator<U, Caps>&) {}
+
+        T* allocate(size_t count) { return static_cast<T*>(CapsAllocate(count * sizeof(T), Caps)); }
+        void deallocate(T* p, size_t) { heap_caps_free(p); }
+
+        template <typename U> bool operator==(const CapsAllocator<U, Caps>&) const { return true; }
+        template <typename U> bool operator!=(const CapsAllocator<U, Caps>&) const { return false; }
+    };
+
+    //Lock-free bounded queue for several producers and consumers (D. Vyukov).
+    //Every cell has a sequence number, push and pop only claim a position with compare_exchange.
+    //push on a full queue returns false. Capacity must be a power of two.
+    template <typename T, size_t Capacity>
+    class BoundedQueue
+    {
+        static_assert((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0), "capacity must be a power of two");
+
+    public:
+        BoundedQueue() : _enqueuePos(0), _dequeuePos(0)
+        {
+            for (size_t i = 0; i < Capacity; i++) _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        static size_t capacity() { return Capacity; }
+
+        //Approximate while other cores push or pop
+        size_t size() const
+        {
+            size_t enqueuePos = _enqueuePos.load(std::memory_order_relaxed);
+            size_t dequeuePos = _dequeuePos.load(std::memory_order_relaxed);
+            return (enqueuePos >= dequeuePos) ? enqueuePos - dequeuePos : 0;
+        }
+
+        bool empty() const { return size() == 0; }
+
+        bool push(const T& value)
+        {
+            return push(value, [](T&) {});
+        }
+
+        //Like push(), prepare edits the copy in the cell before the consumer can see it
+        template<class Prepare>
+        bool push(const T& value, Prepare prepare)
+        {
+            Cell* cell;
+            size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                cell = &_cells[pos & (Capacity - 1)];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+                if (diff == 0)
+                {
+                    if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                }
+                else if (diff < 0) return false;
+                else pos = _enqueuePos.load(std::memory_order_relaxed);
+            }
+            cell->value = value;
+            prepare(cell->value);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& value)
+        {
+            Cell* cell;
+            size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                cell = &_cells[pos & (Capacity - 1)];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+                if (diff == 0)
+                {
+                    if (_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                }
+                else if (diff < 0) return false;
+                else pos = _dequeuePos.load(std::memory_order_relaxed);
+            }
+            value = cell->value;
+            cell->sequence.store(pos + Capacity, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        Cell _cells[Capacity];
+        std::atomic<size_t> _enqueuePos;
+        std::atomic<size_t> _dequeuePos;
+    };
+}
+
+#endif
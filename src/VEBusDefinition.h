@@ -248,6 +248,33 @@ namespace VEBusDefinition
         StateCharge = 0x09
     };
 
+    //Fields with deadband for the New*Available flags
+    enum NotifyField : uint8_t
+    {
+        DcVoltage,
+        DcCurrentInverting,
+        DcCurrentCharging,
+        AcMainVoltage,
+        AcMainCurrent,
+        AcInverterVoltage,
+        AcInverterCurrent,
+        StatusDcCurrent,
+        StatusTemp,
+        LedMinimumInputCurrentLimit,
+        LedMaximumInputCurrentLimit,
+        LedActualInputCurrentLimit,
+        SizeOfNotifyFields
+    };
+
+    enum NotifyGroup : uint8_t
+    {
+        NotifyMasterMultiLed,
+        NotifyMultiPlusStatus,
+        NotifyDcInfo,
+        NotifyAcInfo,
+        SizeOfNotifyGroups
+    };
+
     struct DcInfo
     {
         bool newInfo;
@@ -290,6 +317,52 @@ namespace VEBusDefinition
         }
     };
 
+    //Min/max/mean of all info frames in one window
+    struct Aggregate
+    {
+        float Min;
+        float Max;
+        float Mean;
+        uint32_t Count;
+    };
+
+    struct DcAggregate
+    {
+        uint32_t StartMs;
+        uint32_t WindowMs;
+        Aggregate Voltage;
+        Aggregate CurrentInverting;
+        Aggregate CurrentCharging;
+    };
+
+    struct DcSample
+    {
+        uint32_t TimeMs;
+        float Voltage;
+        float CurrentInverting;
+        float CurrentCharging;
+    };
+
+    struct AcSample
+    {
+        uint32_t TimeMs;
+        float MainVoltage;
+        float MainCurrent;
+        float InverterVoltage;
+        float InverterCurrent;
+    };
+
+    struct AcAggregate
+    {
+        PhaseInfo Phase;
+        uint32_t StartMs;
+        uint32_t WindowMs;
+        Aggregate MainVoltage;
+        Aggregate MainCurrent;
+        Aggregate InverterVoltage;
+        Aggregate InverterCurrent;
+    };
+
 #ifdef MULTIPLUS_II_12_3000
 //GetSettingInfo 13 wrong size 9 [83 83 FE 32 00 8D 89 BB FF]
 //GetSettingInfo 14 wrong size 9 [83 83 FE 09 00 8E 89 E3 FF]
@@ -0,0 +1,104 @@
+/*
+ Name:		VEBusFrameCodec.cpp
+ Author:	nriedle
+*/
+
+#include "VEBusFrameCodec.h"
+#include <string.h>
+
+#define STUFF_BYTE 0xFA
+#define END_OF_FRAME 0xFF
+
+size_t VEBusFrameCodec::StuffedLength(const uint8_t* in, size_t length, size_t offset)
+{
+	size_t result = length;
+	for (size_t i = offset; i < length; i++)
+	{
+		if (in[i] >= STUFF_BYTE) result++;
+	}
+	return result;
+}
+
+size_t VEBusFrameCodec::Stuff(const uint8_t* in, size_t length, uint8_t* out, size_t outSize, size_t offset)
+{
+	if (offset > length) offset = length;
+
+	if (in != out)
+	{
+		if (offset > outSize) return 0;
+		memcpy(out, in, offset);
+		size_t w = offset;
+		for (size_t r = offset; r < length; r++)
+		{
+			uint8_t value = in[r];
+			if (value >= STUFF_BYTE)
+			{
+				if (w + 2 > outSize) return 0;
+				out[w++] = STUFF_BYTE;
+				out[w++] = 0x70 | (value & 0x0F);
+			}
+			else
+			{
+				if (w + 1 > outSize) return 0;
+				out[w++] = value;
+			}
+		}
+		return w;
+	}
+
+	//In place: write from the back, the write position never passes the read position
+	size_t total = StuffedLength(in, length, offset);
+	if (total > outSize) return 0;
+	size_t w = total;
+	for (size_t r = length; r > offset;)
+	{
+		uint8_t value = in[--r];
+		if (value >= STUFF_BYTE)
+		{
+			out[--w] = 0x70 | (value & 0x0F);
+			out[--w] = STUFF_BYTE;
+		}
+		else
+		{
+			out[--w] = value;
+		}
+	}
+	return total;
+}
+
+size_t VEBusFrameCodec::Destuff(const uint8_t* in, size_t length, uint8_t* out, size_t outSize, size_t offset)
+{
+	if (offset > length) offset = length;
+	if (offset > outSize) return 0;
+	if (in != out) memcpy(out, in, offset);
+
+	size_t w = offset;
+	for (size_t r = offset; r < length; r++)
+	{
+		if (w >= outSize) return 0;
+		//0xFA as last byte is kept
+		if (in[r] == STUFF_BYTE && r + 1 < length)
+		{
+			out[w++] = in[++r] + 0x80;
+			continue;
+		}
+		out[w++] = in[r];
+	}
+	return w;
+}
+
+size_t VEBusFrameCodec::AppendChecksum(uint8_t* frame, size_t length, size_t size)
+{
+	uint8_t cs = 1;
+	for (size_t i = 2; i < length; i++) cs -= frame[i];
+
+	if (length + ((cs > STUFF_BYTE) ? 3 : 2) > size) return 0;
+	if (cs > STUFF_BYTE)
+	{
+		frame[length++] = STUFF_BYTE;
+		frame[length++] = cs - STUFF_BYTE;
+	}
+	else frame[length++] = cs;
+	frame[length++] = END_OF_FRAME;
+	return length;
+}
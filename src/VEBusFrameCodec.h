@@ -0,0 +1,31 @@
+// VEBusFrameCodec.h
+
+#ifndef _VEBUSFRAMECODEC_h
+#define _VEBUSFRAMECODEC_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Byte stuffing of VE.Bus frames. Bytes >= 0xFA after the header are sent as 0xFA, 0x70 | (byte & 0x0F).
+//No Arduino dependencies, can be built on the host.
+namespace VEBusFrameCodec
+{
+    //Bytes before offset (MK3/MP ID, frame type, frame nr) are never stuffed
+    const size_t HeaderSize = 4;
+
+    size_t StuffedLength(const uint8_t* in, size_t length, size_t offset = HeaderSize);
+
+    //*Returns the stuffed length, 0 if outSize is too small
+    //*in == out is allowed if outSize >= StuffedLength()
+    size_t Stuff(const uint8_t* in, size_t length, uint8_t* out, size_t outSize, size_t offset = HeaderSize);
+
+    //*Returns the destuffed length, 0 if outSize is too small
+    //*in == out is allowed
+    size_t Destuff(const uint8_t* in, size_t length, uint8_t* out, size_t outSize, size_t offset = HeaderSize);
+
+    //*Appends checksum (stuffed) and end of frame to a stuffed frame, the checksum starts after the 2 ID bytes
+    //*Returns the new length, 0 if size is too small
+    size_t AppendChecksum(uint8_t* frame, size_t length, size_t size);
+}
+
+#endif
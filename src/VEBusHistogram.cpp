@@ -0,0 +1,74 @@
+/*
+ Name:		VEBusHistogram.cpp
+ Author:	nriedle
+*/
+
+#include "VEBusHistogram.h"
+
+void VEBusHistogram::Add(uint32_t us)
+{
+	_buckets[bucketIndex(us)]++;
+	_count++;
+	_sum += us;
+	if (us > _max) _max = us;
+}
+
+void VEBusHistogram::Reset()
+{
+	memset(_buckets, 0, sizeof(_buckets));
+	_count = 0;
+	_max = 0;
+	_sum = 0;
+}
+
+uint32_t VEBusHistogram::Count()
+{
+	return _count;
+}
+
+uint32_t VEBusHistogram::Max()
+{
+	return _max;
+}
+
+uint64_t VEBusHistogram::Sum()
+{
+	return _sum;
+}
+
+uint32_t VEBusHistogram::Percentile(uint8_t percent)
+{
+	if (_count == 0) return 0;
+	if (percent > 100) percent = 100;
+
+	//Rank of the sample, rounded up
+	uint32_t rank = ((uint64_t)_count * percent + 99) / 100;
+	if (rank == 0) rank = 1;
+	uint32_t seen = 0;
+	for (uint8_t i = 0; i < BucketCount; i++)
+	{
+		seen += _buckets[i];
+		if (seen < rank) continue;
+		if (i == BucketCount - 1) return _max;
+		uint32_t start = bucketStart(i);
+		uint32_t value = start + (bucketStart(i + 1) - start) / 2;
+		return (value > _max) ? _max : value;
+	}
+	return _max;
+}
+
+//0-7 exact, then 4 buckets per power of two: 8, 10, 12, 14, 16, 20, 24, 28, 32, ...
+uint8_t VEBusHistogram::bucketIndex(uint32_t us)
+{
+	if (us < 8) return us;
+	uint8_t octave = 31 - __builtin_clz(us);
+	uint8_t index = 8 + (octave - 3) * 4 + ((us >> (octave - 2)) & 3);
+	return (index < BucketCount) ? index : BucketCount - 1;
+}
+
+uint32_t VEBusHistogram::bucketStart(uint8_t index)
+{
+	if (index < 8) return index;
+	uint8_t octave = 3 + (index - 8) / 4;
+	return (uint32_t)(4 + (index - 8) % 4) << (octave - 2);
+}
@@ -0,0 +1,35 @@
+// VEBusHistogram.h
+
+#ifndef _VEBUSHISTOGRAM_h
+#define _VEBUSHISTOGRAM_h
+
+#include "arduino.h"
+
+//Log-linear histogram of durations in us. Exact below 8 us, above 4 buckets per power of two
+//(percentiles within 12.5 %) up to 2^26 us (67 s), larger values count into the last bucket.
+//Not thread safe.
+class VEBusHistogram
+{
+public:
+    static const uint8_t BucketCount = 100;
+
+    void Add(uint32_t us);
+    void Reset();
+    uint32_t Count();
+    uint32_t Max();
+    //*Sum of all samples in us
+    uint64_t Sum();
+    //*Value below which percent of the samples are, middle of the bucket. 0 without samples
+    uint32_t Percentile(uint8_t percent);
+
+private:
+    uint32_t _buckets[BucketCount] = {};
+    uint32_t _count = 0;
+    uint32_t _max = 0;
+    uint64_t _sum = 0;
+
+    static uint8_t bucketIndex(uint32_t us);
+    static uint32_t bucketStart(uint8_t index);
+};
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ Name:		VEBusHistory.cpp
+ Author:	nriedle
+*/
+
+#include "VEBusHistory.h"
+#include "esp_heap_caps.h"
+#if __has_include("esp_memory_utils.h")
+#include "esp_memory_utils.h"
+#else
+#include "soc/soc_memory_layout.h"
+#endif
+#include "VEBusAttr.h"
+
+VEBusHistory::VEBusHistory()
+{
+}
+
+VEBusHistory::~VEBusHistory()
+{
+	Free();
+	SemaphoreHandle_t semaphore = _semaphore.load();
+	if (semaphore != NULL) vSemaphoreDelete(semaphore);
+}
+
+bool VEBusHistory::Allocate(size_t bytes, uint8_t valueCount)
+{
+	Free();
+	if ((valueCount == 0) || (valueCount > MaxValues)) return false;
+	uint32_t blockCount = bytes / BlockSize;
+	if (blockCount < 2) return false;
+
+	if (_semaphore.load() == NULL)
+	{
+		SemaphoreHandle_t created = xSemaphoreCreateMutex();
+		if (created == NULL) return false;
+		SemaphoreHandle_t expected = NULL;
+		if (!_semaphore.compare_exchange_strong(expected, created)) vSemaphoreDelete(created);
+	}
+
+	uint8_t* blocks = (uint8_t*)heap_caps_malloc(blockCount * BlockSize, VEBUS_COLD_CAPS);
+	if (blocks == nullptr) blocks = (uint8_t*)heap_caps_malloc(blockCount * BlockSize, VEBUS_HOT_CAPS);
+	if (blocks == nullptr) return false;
+
+	SemaphoreHandle_t semaphore = _semaphore.load();
+	xSemaphoreTake(semaphore, portMAX_DELAY);
+	_blocks = blocks;
+	_blockCount = blockCount;
+	_valueCount = valueCount;
+	_firstBlock = 0;
+	_lastBlock = 0;
+	_empty = true;
+	xSemaphoreGive(semaphore);
+	return true;
+}
+
+void VEBusHistory::Free()
+{
+	SemaphoreHandle_t semaphore = _semaphore.load();
+	if (semaphore == NULL) return;
+	xSemaphoreTake(semaphore, portMAX_DELAY);
+	uint8_t* blocks = _blocks;
+	_blocks = nullptr;
+	_blockCount = 0;
+	_empty = true;
+	xSemaphoreGive(semaphore);
+	if (blocks != nullptr) heap_caps_free(blocks);
+}
+
+bool VEBusHistory::IsAllocated()
+{
+	return _blocks != nullptr;
+}
+
+bool VEBusHistory::IsPsram()
+{
+	SemaphoreHandle_t semaphore = _semaphore.load();
+	if (semaphore == NULL) return false;
+	xSemaphoreTake(semaphore, portMAX_DELAY);
+	bool psram = (_blocks != nullptr) && esp_ptr_external_ram(_blocks);
+	xSemaphoreGive(semaphore);
+	return psram;
+}
+
+void VEBusHistory::Add(uint32_t timeMs, const int32_t* values)
+{
+	SemaphoreHandle_t semaphore = _semaphore.load();
+	if (semaphore == NULL) return;
+	xSemaphoreTake(semaphore, portMAX_DELAY);
+	if (_blocks == nullptr)
+	{
+		xSemaphoreGive(semaphore);
+		return;
+	}
+
+	if (_empty)
+	{
+		_empty = false;
+		_firstBlock = 0;
+		_lastBlock = 0;
+		startBlock(timeMs, values);
+		xSemaphoreGive(semaphore);
+		return;
+	}
+
+	//Time difference, then zigzag coded value differences
+	uint8_t record[5 * (MaxValues + 1)];
+	uint8_t size = writeVarint(record, timeMs - _lastSample.timeMs);
+	for (uint8_t i = 0; i < _valueCount; i++)
+	{
+		int32_t delta = (int32_t)((uint32_t)values[i] - (uint32_t)_lastSample.values[i]);
+		size += writeVarint(&record[size], ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+	}
+
+	BlockHeader* header = (BlockHeader*)block(_lastBlock);
+	if (header->used + size > BlockSize)
+	{
+		_lastBlock++;
+		if (_lastBlock - _firstBlock >= _blockCount) _firstBlock++;
+		startBlock(timeMs, values);
+	}
+	else
+	{
+		memcpy((uint8_t*)header + header->used, record, size);
+		header->used += size;
+		header->count++;
+		_lastSample.timeMs = timeMs;
+		for (uint8_t i = 0; i < _valueCount; i++) _lastSample.values[i] = values[i];
+	}
+	xSemaphoreGive(semaphore);
+}
+
+size_t VEBusHistory::Query(uint32_t fromMs, uint32_t toMs, uint32_t resolutionMs, size_t maxSamples, SampleCallback callback, void* context)
+{
+	uint8_t data[BlockSize];
+	size_t written = 0;
+	bool done = (maxSamples == 0);
+	int64_t sums[MaxValues] = {};
+	uint32_t sumCount = 0;
+	uint32_t bucket = 0;
+	uint8_t valueCount;
+	uint32_t sequence;
+
+	SemaphoreHandle_t semaphore = _semaphore.load();
+	if (semaphore == NULL) return 0;
+	xSemaphoreTake(semaphore, portMAX_DELAY);
+	valueCount = _valueCount;
+	sequence = _firstBlock;
+	if (_blocks == nullptr || _empty) done = true;
+	xSemaphoreGive(semaphore);
+
+	auto flush = [&]() {
+		if (sumCount == 0) return;
+		Sample sample;
+		sample.timeMs = fromMs + bucket * resolutionMs;
+		for (uint8_t i = 0; i < valueCount; i++) sample.values[i] = (int32_t)(sums[i] / (int64_t)sumCount);
+		for (uint8_t i = 0; i < valueCount; i++) sums[i] = 0;
+		sumCount = 0;
+		callback(sample, written++, context);
+		if (written >= maxSamples) done = true;
+	};
+
+	auto add = [&](Sample& sample) {
+		if ((int32_t)(sample.timeMs - toMs) > 0)
+		{
+			done = true;
+			return;
+		}
+		if ((int32_t)(sample.timeMs - fromMs) < 0) return;
+
+		if (resolutionMs == 0)
+		{
+			callback(sample, written++, context);
+			if (written >= maxSamples) done = true;
+			return;
+		}
+
+		uint32_t sampleBucket = (sample.timeMs - fromMs) / resolutionMs;
+		if (sampleBucket != bucket) flush();
+		if (done) return;
+		bucket = sampleBucket;
+		for (uint8_t i = 0; i < valueCount; i++) sums[i] += sample.values[i];
+		sumCount++;
+	};
+
+	//Blocks are copied one by one, the writer on core 0 is never blocked for long
+	while (!done)
+	{
+		xSemaphoreTake(semaphore, portMAX_DELAY);
+		if ((int32_t)(sequence - _firstBlock) < 0) sequence = _firstBlock;
+		if ((_blocks == nullptr) || ((int32_t)(sequence - _lastBlock) > 0))
+		{
+			xSemaphoreGive(semaphore);
+			break;
+		}
+		memcpy(data, block(sequence), BlockSize);
+		xSemaphoreGive(semaphore);
+
+		BlockHeader* header = (BlockHeader*)data;
+		Sample sample;
+		sample.timeMs = header->timeMs;
+		memcpy(sample.values, data + sizeof(BlockHeader), valueCount * sizeof(int32_t));
+		add(sample);
+
+		size_t position = headerSize(valueCount);
+		for (uint16_t i = 1; (i < header->count) && !done; i++)
+		{
+			if (!decodeSample(data, header->used, position, sample)) break;
+			add(sample);
+		}
+		sequence++;
+	}
+
+	if (written < maxSamples) flush();
+	return written;
+}
+
+uint8_t* VEBusHistory::block(uint32_t sequence)
+{
+	return _blocks + (sequence % _blockCount) * BlockSize;
+}
+
+void VEBusHistory::startBlock(uint32_t timeMs, const int32_t* values)
+{
+	uint8_t* data = block(_lastBlock);
+	BlockHeader* header = (BlockHeader*)data;
+	header->timeMs = timeMs;
+	header->used = headerSize(_valueCount);
+	header->count = 1;
+	memcpy(data + sizeof(BlockHeader), values, _valueCount * sizeof(int32_t));
+
+	_lastSample.timeMs = timeMs;
+	for (uint8_t i = 0; i < _valueCount; i++) _lastSample.values[i] = values[i];
+}
+
+//sample holds the previous sample and is updated in place
+bool VEBusHistory::decodeSample(const uint8_t* data, size_t size, size_t& position, Sample& sample)
+{
+	uint32_t value;
+	if (!readVarint(data, size, position, value)) return false;
+	sample.timeMs += value;
+	for (uint8_t i = 0; i < _valueCount; i++)
+	{
+		if (!readVarint(data, size, position, value)) return false;
+		int32_t delta = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+		sample.values[i] = (int32_t)((uint32_t)sample.values[i] + (uint32_t)delta);
+	}
+	return true;
+}
+
+size_t VEBusHistory::headerSize(uint8_t valueCount)
+{
+	return sizeof(BlockHeader) + valueCount * sizeof(int32_t);
+}
+
+uint8_t VEBusHistory::writeVarint(uint8_t* out, uint32_t value)
+{
+	uint8_t size = 0;
+	while (value >= 0x80)
+	{
+		out[size++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[size++] = value;
+	return size;
+}
+
+bool VEBusHistory::readVarint(const uint8_t* data, size_t size, size_t& position, uint32_t& value)
+{
+	value = 0;
+	for (uint8_t shift = 0; shift < 35; shift += 7)
+	{
+		if (position >= size) return false;
+		uint8_t byte = data[position++];
+		value |= (uint32_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) return true;
+	}
+	return false;
+}
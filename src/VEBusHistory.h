@@ -0,0 +1,70 @@
+// VEBusHistory.h
+
+#ifndef _VEBUSHISTORY_h
+#define _VEBUSHISTORY_h
+
+#include "arduino.h"
+#include <atomic>
+
+//Time series of raw values, delta encoded in a ring of blocks.
+//Every block starts with a full sample, followed by varint coded differences.
+//When the ring is full the oldest block is dropped.
+class VEBusHistory
+{
+public:
+    static const uint8_t MaxValues = 6;
+    static const size_t BlockSize = 256;
+
+    struct Sample
+    {
+        uint32_t timeMs;
+        int32_t values[MaxValues];
+    };
+
+    typedef void (*SampleCallback)(const Sample& sample, size_t index, void* context);
+
+    VEBusHistory();
+    ~VEBusHistory();
+
+    //*Uses PSRAM (VEBUS_COLD_CAPS) if available, otherwise internal RAM. Returns false if allocation failed
+    bool Allocate(size_t bytes, uint8_t valueCount);
+    void Free();
+    bool IsAllocated();
+    //*True if the buffer is in external RAM
+    bool IsPsram();
+
+    void Add(uint32_t timeMs, const int32_t* values);
+
+    //*Mean of all samples per resolutionMs from fromMs to toMs (both included), oldest first
+    //*resolutionMs = 0 returns every sample. Returns the number of samples passed to callback
+    size_t Query(uint32_t fromMs, uint32_t toMs, uint32_t resolutionMs, size_t maxSamples, SampleCallback callback, void* context);
+
+private:
+    struct BlockHeader
+    {
+        uint32_t timeMs;
+        uint16_t used;
+        uint16_t count;
+    };
+
+    uint8_t* _blocks = nullptr;
+    uint32_t _blockCount = 0;
+    uint8_t _valueCount = 0;
+    //Sequence numbers, block index = sequence % _blockCount
+    uint32_t _firstBlock = 0;
+    uint32_t _lastBlock = 0;
+    bool _empty = true;
+    Sample _lastSample;
+    //Created by the first Allocate(), a history that is never allocated needs no mutex
+    std::atomic<SemaphoreHandle_t> _semaphore{ NULL };
+
+    uint8_t* block(uint32_t sequence);
+    void startBlock(uint32_t timeMs, const int32_t* values);
+    bool decodeSample(const uint8_t* data, size_t size, size_t& position, Sample& sample);
+
+    static size_t headerSize(uint8_t valueCount);
+    static uint8_t writeVarint(uint8_t* out, uint32_t value);
+    static bool readVarint(const uint8_t* data, size_t size, size_t& position, uint32_t& value);
+};
+
+#endif